@@ -50,6 +50,8 @@ const char *prompt = "rtgi > ";
 
 void run(gi_algorithm *algo);
 void rt_bench();
+void sample_bench(recursive_algorithm *algo, int passes);
+void batch_bench(wf::cpu::batch_rt_adapter *rt, int passes);
 
 static bool align_rt_and_algo(scene &scene, gi_algorithm *algo, repl_update_checks &uc, const std::string &command) {
 	return true;
@@ -180,8 +182,13 @@ void repl(istream &infile, repl_update_checks &uc) {
 		else ifcmd("raytracer") {
 			string name;
 			in >> name;
-			if (name == "seq") scene.use(new seq_tri_is);
-			else if (name == "naive-bvh") scene.use(new naive_bvh);
+			// "raytracer batch <tracer>" traces whole wavefronts with the given tracer, see wf::cpu::batch_rt_adapter
+			bool batch = name == "batch";
+			if (batch)
+				in >> name;
+			individual_ray_tracer *rt = nullptr;
+			if (name == "seq") rt = new seq_tri_is;
+			else if (name == "naive-bvh") rt = new naive_bvh;
 			else if (name == "bbvh") {
 				string tag1, tag2;
 				in >> tag1 >> tag2;
@@ -190,18 +197,22 @@ void repl(istream &infile, repl_update_checks &uc) {
 				if (tag1 == "indexed" || tag2 == "indexed") flat = false;
 				if (tag1 == "esc" || tag2 == "esc") esc = true;
 				if (flat && !esc)
-					scene.use(new binary_bvh_tracer<bbvh_triangle_layout::flat, bbvh_esc_mode::off>);
+					rt = new binary_bvh_tracer<bbvh_triangle_layout::flat, bbvh_esc_mode::off>;
 				else if (!flat && !esc)
-					scene.use(new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off>);
+					rt = new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
 				else if (!flat && esc)
-					scene.use(new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on>);
+					rt = new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
 				else if (flat && esc)
 					error("This combination is technically problematic")
 				else
 					error("There is no such bbvh variant");
-				if (!align_rt_and_algo(scene, algo, uc, command)) continue;
 			}
 			else error("There is no ray tracer called '" << name << "'");
+			if (batch)
+				scene.use(new wf::cpu::batch_rt_adapter(rt));
+			else
+				scene.use(rt);
+			if (!align_rt_and_algo(scene, algo, uc, command)) continue;
 			uc.tracer_touched_at = uc.cmdid;
 		}
 		else ifcmd("commit") {
@@ -227,6 +238,8 @@ void repl(istream &infile, repl_update_checks &uc) {
 				error("The current tracer does (might?) not have an up-to-date acceleration structure");
 			if (uc.accel_touched_at < uc.scene_touched_at)
 				error("The current acceleration structure is out-dated");
+			if (dynamic_cast<recursive_algorithm*>(algo) && !scene.single_rt)
+				error("The algorithm traces one ray at a time, this does not work with a batch ray tracer");
 			run(algo);
 		}
 		else ifcmd("rt_bench") {
@@ -237,11 +250,45 @@ void repl(istream &infile, repl_update_checks &uc) {
 				error("The current tracer does (might?) not have an up-to-date acceleration structure");
 			if (uc.accel_touched_at < uc.scene_touched_at)
 				error("The current acceleration structure is out-dated");
+			if (!scene.single_rt)
+				error("rt_bench traces one ray at a time, this does not work with a batch ray tracer");
 			rt_bench(rc);
 #else
 			cerr << "ERROR: cannot run rt-bench when WITH_STATS is defined" << endl;
 #endif
 		}
+		else ifcmd("sample_bench") {
+			int passes = 1;
+			if (!in.eof())
+				in >> passes;
+			check_in_complete("Syntax error, takes an optional number of passes");
+			if (uc.scene_touched_at == 0 || uc.tracer_touched_at == 0 || uc.accel_touched_at == 0 || algo == nullptr)
+				error("We have to have a scene loaded, a ray tracer set, an acceleration structure built and an algorithm set prior to running");
+			if (uc.accel_touched_at < uc.scene_touched_at || uc.accel_touched_at < uc.tracer_touched_at)
+				error("The current acceleration structure is out-dated");
+			recursive_algorithm *rec = dynamic_cast<recursive_algorithm*>(algo);
+			if (!rec)
+				error("The current algorithm does not sample pixels one path at a time");
+			if (!scene.single_rt)
+				error("The algorithm traces one ray at a time, this does not work with a batch ray tracer");
+			sample_bench(rec, passes);
+		}
+		else ifcmd("batch_bench") {
+			int passes = 1;
+			if (!in.eof())
+				in >> passes;
+			check_in_complete("Syntax error, takes an optional number of passes");
+			if (passes <= 0)
+				error("The number of passes has to be positive");
+			if (uc.scene_touched_at == 0 || uc.tracer_touched_at == 0 || uc.accel_touched_at == 0)
+				error("We have to have a scene loaded, a ray tracer set, an acceleration structure built prior to running");
+			if (uc.accel_touched_at < uc.scene_touched_at || uc.accel_touched_at < uc.tracer_touched_at)
+				error("The current acceleration structure is out-dated");
+			auto *rt = dynamic_cast<wf::cpu::batch_rt_adapter*>(scene.batch_rt);
+			if (!rt)
+				error("The current ray tracer does not trace batches (see \"raytracer batch ...\")");
+			batch_bench(rt, passes);
+		}
 		else ifcmd("mesh") {
 			string name, cmd;
 			in >> name;
@@ -382,6 +429,31 @@ void repl(istream &infile, repl_update_checks &uc) {
 			else
 				error("Syntax error: expected 'on' or 'off'");
 		}
+		else ifcmd("tiles") {
+			string sub;
+			in >> sub;
+			if (sub == "size") {
+				int size;
+				in >> size;
+				check_in_complete("Syntax error, requires exactly one positive integral value");
+				if (size <= 0)
+					error("Tile size has to be positive");
+				rc->scheduler.tile_size = size;
+			}
+			else if (sub == "order") {
+				string order;
+				in >> order;
+				check_in_complete("Syntax error, expected scanline, morton or hilbert");
+				if (order == "scanline")     rc->scheduler.tile_order = tile_scheduler::scanline;
+				else if (order == "morton")  rc->scheduler.tile_order = tile_scheduler::morton;
+				else if (order == "hilbert") rc->scheduler.tile_order = tile_scheduler::hilbert;
+				else error("Syntax error, expected scanline, morton or hilbert");
+			}
+			else if (sub == "stats")
+				rc->scheduler.print_stats();
+			else
+				error("No such tiles subcommand");
+		}
 		else ifcmd("stats") {
 			string sub;
 			in >> sub;
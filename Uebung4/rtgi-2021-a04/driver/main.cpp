@@ -5,6 +5,7 @@
 #include "libgi/framebuffer.h"
 #include "libgi/context.h"
 #include "libgi/timer.h"
+#include "libgi/wavefront-rt.h"
 
 #include "libgi/global-context.h"
 
@@ -16,6 +17,9 @@
 #include <iostream>
 #include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <new>
 #include <omp.h>
 
 #define GLM_ENABLE_EXPERIMENTAL
@@ -41,7 +45,9 @@ void run(gi_algorithm *algo) {
 	test_camrays(rc->scene.camera);
 	rc->framebuffer.clear();
 
+	rc->scheduler.clear_stats();
 	algo->compute_samples();
+	rc->scheduler.print_summary();
 	algo->finalize_frame();
 	
 	rc->framebuffer.png().write(cmdline.outfile);
@@ -59,11 +65,133 @@ void rt_bench() {
 	
 	//calculate closest triangle intersection for each ray
 	raii_timer bench_timer("rt_bench");
-	rays.for_each([&](unsigned x, unsigned y) {
+	rc->scheduler.for_each_pixel(rays.w, rays.h, [&](unsigned x, unsigned y) {
 		triangle_intersections(x, y) = rc->scene.single_rt->closest_hit(rays(x, y));
 	});
 }
 
+/*! \brief Times the wavefront of a \ref wf::cpu::batch_rt_adapter with and without sorting the rays.
+ *
+ *  Two wavefronts of the camera's resolution are traced \c passes times each: the camera rays, and one bounce from
+ *  their hit points into random directions (from a fixed seed), which is where sorting is supposed to help.  The
+ *  results of both variants are compared to tracing the same rays one by one with the underlying tracer.
+ */
+void batch_bench(wf::cpu::batch_rt_adapter *rt, int passes) {
+	int n = rc->w() * rc->h();
+	vector<triangle_intersection> reference(n);
+	auto trace = [&](const char *name) {
+		ray *rays = rt->rd.rays;
+		triangle_intersection *is = rt->rd.intersections;
+		#pragma omp parallel for
+		for (int i = 0; i < n; ++i)
+			reference[i] = rt->underlying()->closest_hit(rays[i]);
+		bool reorder = rt->reorder_rays;
+		for (bool sorted : {false, true}) {
+			rt->reorder_rays = sorted;
+			auto start = chrono::steady_clock::now();
+			for (int i = 0; i < passes; ++i)
+				rt->compute_closest_hit();
+			auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+			int differ = 0;
+			for (int i = 0; i < n; ++i)
+				if (is[i].valid() != reference[i].valid() || (is[i].valid() && (is[i].t != reference[i].t || is[i].ref != reference[i].ref)))
+					++differ;
+			cout << name << (sorted ? "sorted:   " : "unsorted: ") << ms << " ms for " << passes << " x " << n << " rays";
+			if (differ)
+				cout << ", " << differ << " hits differ from tracing ray by ray";
+			cout << endl;
+		}
+		rt->reorder_rays = reorder;
+	};
+
+	wf::cpu::batch_cam_ray_setup_cpu().run();
+	trace("camera rays, ");
+
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> uniform(-1, 1);
+	const aabb &bounds = rc->scene.scene_bounds;
+	for (int i = 0; i < n; ++i) {
+		const ray &view = rt->rd.rays[i];
+		const triangle_intersection &hit = rt->rd.intersections[i];
+		vec3 d;
+		do d = vec3(uniform(rng), uniform(rng), uniform(rng)); while (dot(d, d) > 1 || dot(d, d) < 1e-4f);
+		vec3 o = hit.valid() ? view.o + hit.t * view.d
+		                     : bounds.min + (bounds.max - bounds.min) * (vec3(uniform(rng), uniform(rng), uniform(rng)) * 0.5f + 0.5f);
+		rt->rd.rays[i] = ray(o, normalize(d));
+	}
+	trace("bounce rays, ");
+}
+
+/*! Counts calls to operator new while \ref count_allocations is set, see \ref sample_bench.
+ *  The flag is only changed outside of parallel regions.
+ *
+ *  Replacing the global allocation functions affects the whole program, so this is only compiled in with
+ *  configure --enable-allocation-counting.  All the (non-aligned) forms are replaced together, so that memory is
+ *  always released by the counterpart of the function that allocated it.
+ */
+static bool count_allocations = false;
+static std::atomic<uint64_t> allocations(0);
+
+#ifdef RTGI_COUNT_ALLOCATIONS
+static void* counted_malloc(std::size_t n) noexcept {
+	if (count_allocations)
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(n ? n : 1);
+}
+
+void* operator new(std::size_t n) {
+	if (void *p = counted_malloc(n))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) {
+	if (void *p = counted_malloc(n))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept   { return counted_malloc(n); }
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept { return counted_malloc(n); }
+
+void operator delete(void *p) noexcept                              { std::free(p); }
+void operator delete[](void *p) noexcept                            { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept                 { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept               { std::free(p); }
+void operator delete(void *p, const std::nothrow_t&) noexcept       { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t&) noexcept     { std::free(p); }
+#endif
+
+/*! \brief Compares the sample_result interface of \ref recursive_algorithm to \ref sample_sink.
+ *
+ *  Both variants take one sample per pixel and pass, the results go to a scratch framebuffer.
+ */
+void sample_bench(recursive_algorithm *algo, int passes) {
+	algo->prepare_frame();
+	framebuffer fb(rc->w(), rc->h());
+	auto measure = [&](const char *name, auto &&pixel) {
+		allocations = 0;
+		count_allocations = true;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < passes; ++i)
+			rc->scheduler.for_each_pixel(rc->w(), rc->h(), pixel);
+		auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+		count_allocations = false;
+#ifdef RTGI_COUNT_ALLOCATIONS
+		cout << name << ms << " ms, " << allocations << " allocations ("
+		     << double(allocations) / (double(passes) * rc->w() * rc->h()) << " per pixel and pass)" << endl;
+#else
+		cout << name << ms << " ms (configure with --enable-allocation-counting to count allocations)" << endl;
+#endif
+	};
+	measure("sample_result: ", [&](unsigned x, unsigned y) {
+		fb.add(x, y, algo->sample_pixel(x, y, 1));
+	});
+	measure("sample_sink:   ", [&](unsigned x, unsigned y) {
+		sample_sink sink;
+		algo->sample_pixel(x, y, 1, sink);
+		fb.add(x, y, sink);
+	});
+}
+
 int main(int argc, char **argv)
 {
 	parse_cmdline(argc, argv);
@@ -79,5 +207,7 @@ int main(int argc, char **argv)
 	stats_timer.print();
 
 	delete rc->algo;
+	// batch tracers deregister from rc when they go away, so they have to go before rc does
+	rc->scene.use(nullptr);
 	return 0;
 }
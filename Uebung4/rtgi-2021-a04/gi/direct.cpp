@@ -12,9 +12,8 @@
 using namespace glm;
 using namespace std;
 
-gi_algorithm::sample_result direct_light::sample_pixel(uint32_t x, uint32_t y, uint32_t samples)
+void direct_light::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink)
 {
-	sample_result result;
 	for (int sample = 0; sample < samples; ++sample)
 	{
 		vec3 radiance(0, 0, 0);
@@ -40,9 +39,8 @@ gi_algorithm::sample_result direct_light::sample_pixel(uint32_t x, uint32_t y, u
 					radiance = sample_lights(dg, view_ray);
 			}
 		}
-		result.push_back({radiance, vec2(0)});
+		sink.add(radiance);
 	}
-	return result;
 }
 
 vec3 direct_light::sample_uniformly(const diff_geom &hit, const ray &view_ray)
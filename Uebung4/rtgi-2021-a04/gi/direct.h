@@ -16,7 +16,8 @@ protected:
 #endif
 
 public:
-	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) override;
+	using recursive_algorithm::sample_pixel;
+	void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) override;
 	bool interprete(const std::string &command, std::istringstream &in) override;
 };
 
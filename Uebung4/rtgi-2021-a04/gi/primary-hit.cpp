@@ -13,8 +13,7 @@
 using namespace glm;
 using namespace std;
 
-gi_algorithm::sample_result primary_hit_display::sample_pixel(uint32_t x, uint32_t y, uint32_t samples) {
-	sample_result result;
+void primary_hit_display::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) {
 	for (int sample = 0; sample < samples; ++sample) {
 		vec3 radiance(0);
 		ray view_ray = cam_ray(rc->scene.camera, x, y, glm::vec2(rc->rng.uniform_float()-0.5f, rc->rng.uniform_float()-0.5f));
@@ -23,13 +22,11 @@ gi_algorithm::sample_result primary_hit_display::sample_pixel(uint32_t x, uint32
 			diff_geom dg(closest, rc->scene);
 			radiance = dg.albedo();
 		}
-		result.push_back({radiance,vec2(0)});
+		sink.add(radiance);
 	}
-	return result;
 }
 
-gi_algorithm::sample_result local_illumination::sample_pixel(uint32_t x, uint32_t y, uint32_t samples) {
-	sample_result result;
+void local_illumination::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) {
 	for (int sample = 0; sample < samples; ++sample) {
 		vec3 radiance(0);
 		ray view_ray = cam_ray(rc->scene.camera, x, y, glm::vec2(rc->rng.uniform_float()-0.5f, rc->rng.uniform_float()-0.5f));
@@ -50,8 +47,7 @@ gi_algorithm::sample_result local_illumination::sample_pixel(uint32_t x, uint32_
 			if (!rc->scene.single_rt->any_hit(shadow_ray))
 				radiance = pl->power() * brdf->f(dg, w_o, w_i) / (d*d);
 		}
-		result.push_back({radiance,vec2(0)});
+		sink.add(radiance);
 	}
-	return result;
 }
 
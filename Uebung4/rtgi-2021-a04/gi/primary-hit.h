@@ -12,12 +12,14 @@
  */
 class primary_hit_display : public recursive_algorithm {
 public:
-	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) override;
+	using recursive_algorithm::sample_pixel;
+	void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) override;
 };
 
 class local_illumination : public recursive_algorithm {
 public:
-	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) override;
+	using recursive_algorithm::sample_pixel;
+	void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) override;
 };
 
 
@@ -42,6 +42,9 @@ static std::string timediff(unsigned ms) {
  *
  *  Note: We first compute a single sample to get a rough estimate of how long rendering is going to take.
  *
+ *  Note: The tiles are distributed dynamically over the threads, so the random numbers are seeded per tile and pass
+ *        to get the same image for the same settings, independent of the number of threads and the tile order.
+ *
  *  Note: Times reported via \ref stats_timer might not be perfectly reliable as of now.  This is because the
  *        timer-overhead is in the one (at times even two) digit percentages of the individual fragments measured.
  *
@@ -49,24 +52,42 @@ static std::string timediff(unsigned ms) {
 
 void recursive_algorithm::compute_samples() {
 	using namespace std::chrono;
+	auto sample_tiles = [&](uint32_t samples, uint32_t pass) {
+		rc->scheduler.run(rc->w(), rc->h(), [&](const tile_scheduler::tile &tile) {
+			rc->rng.seed(tile.id, pass);
+			tile_scheduler::for_each_pixel(tile, [&](unsigned x, unsigned y) {
+				sample_sink sink;
+				sample_pixel(x, y, samples, sink);
+				rc->framebuffer.add(x, y, sink);
+			});
+		});
+	};
 	auto start = system_clock::now();
-	rc->framebuffer.color.for_each([&](unsigned x, unsigned y) {
-										rc->framebuffer.add(x, y, sample_pixel(x, y, 1));
-    							   });
+	sample_tiles(1, 0);
 	auto delta_ms = duration_cast<milliseconds>(system_clock::now() - start).count();
 	std::cout << "Will take around " << timediff(delta_ms*(rc->sppx-1)) << " to complete" << std::endl;
 	
-	rc->framebuffer.color.for_each([&](unsigned x, unsigned y) {
-										rc->framebuffer.add(x, y, sample_pixel(x, y, rc->sppx-1));
-    							   });
+	sample_tiles(rc->sppx-1, 1);
 	delta_ms = duration_cast<milliseconds>(system_clock::now() - start).count();
 	std::cout << "Took " << timediff(delta_ms) << " (" << delta_ms << " ms) " << " to complete" << std::endl;
 }
 
+gi_algorithm::sample_result recursive_algorithm::sample_pixel(uint32_t x, uint32_t y, uint32_t samples) {
+	sample_result result;
+	sample_sink sink(&result);
+	sample_pixel(x, y, samples, sink);
+	return result;
+}
+
 void recursive_algorithm::prepare_frame() {
 	assert(rc->scene.single_rt != nullptr);
 }
 
+void sample_result_algorithm::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) {
+	for (auto [c,p] : sample_pixel(x, y, samples))
+		sink.add(c, p);
+}
+
 
 
 /*  Implementaiton for "one bounce at a time" traversal
@@ -43,20 +43,47 @@ public:
  
 
 
+/*  \brief Collects the samples taken for a single pixel without allocating.
+ *
+ *  The \ref framebuffer only needs the sum and the number of samples, so that is all that is kept.  If \c record is
+ *  set the individual samples are appended to it as well, this is how the \ref gi_algorithm::sample_result interface
+ *  is provided on top of it.
+ *
+ */
+struct sample_sink {
+	vec3 sum = vec3(0);
+	uint32_t count = 0;
+	gi_algorithm::sample_result *record = nullptr;
+
+	sample_sink(gi_algorithm::sample_result *record = nullptr) : record(record) {}
+	void add(const vec3 &radiance, const vec2 &pos = vec2(0)) {
+		sum += radiance;
+		++count;
+		if (record) record->push_back({radiance, pos});
+	}
+};
+
+
+
 /*  This is the basic CPU style "one path at a time, all the way down" algorithm.
  *
  *  sample_pixel is called for each pixel in the target-image to compute a number of samples which are accumulated by
  *  the \ref framebuffer.
  *   - x, y are the pixel coordinates to sample a ray for.
  *   - samples is the number of samples to take
+ *   - sink receives the samples (see \ref sample_sink)
  *   - render_context holds contextual information for rendering (e.g. a random number generator)
  *
+ *  The version returning a sample_result records the samples via the sink, it allocates for every pixel.  Algorithms
+ *  written against that interface derive from \ref sample_result_algorithm instead.
+ *
  */
 class recursive_algorithm : public gi_algorithm {
 public:
 	using gi_algorithm::gi_algorithm;
 
-	virtual sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) = 0;
+	virtual void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) = 0;
+	sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples);
 
 	void compute_samples() override;
 	void prepare_frame() override;
@@ -64,6 +91,20 @@ public:
 
 
 
+/*  Adapter for algorithms that return the samples of a pixel as a \ref gi_algorithm::sample_result (as all of them did
+ *  before \ref sample_sink).  Only the sample_result version has to be implemented.
+ *
+ */
+class sample_result_algorithm : public recursive_algorithm {
+public:
+	using recursive_algorithm::recursive_algorithm;
+
+	void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) override final;
+	virtual sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) = 0;
+};
+
+
+
 /*  This is the basic GPU-style "one segment at a time" algorithm.
  *  
  *  Use this to provide algorithms of this kind.
@@ -3,6 +3,7 @@
 #include "scene.h"
 #include "random.h"
 #include "framebuffer.h"
+#include "scheduler.h"
 
 #include <functional>
 #include <map>
@@ -17,6 +18,7 @@ struct render_context {
 	::scene scene;
 	::framebuffer framebuffer;
 	gi_algorithm *algo = nullptr;
+	tile_scheduler scheduler;
 	unsigned int sppx = 1;
 	render_context() : framebuffer(scene.camera.w, scene.camera.h) {
 		call_at_resolution_change[&framebuffer] = [this](int w, int h) { framebuffer.resize(w, h); };
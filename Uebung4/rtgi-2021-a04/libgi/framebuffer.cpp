@@ -7,14 +7,19 @@ void framebuffer::clear() {
 	color.clear(vec4(0,0,0,0));
 }
 
-void framebuffer::add(unsigned x, unsigned y, gi_algorithm::sample_result res) {
-	vec3 acc = vec3(0);
+void framebuffer::add(unsigned x, unsigned y, const gi_algorithm::sample_result &res) {
+	sample_sink samples;
 	for (auto [c,p] : res)
-		acc += c;
+		samples.add(c, p);
+	add(x, y, samples);
+}
+
+void framebuffer::add(unsigned x, unsigned y, const sample_sink &samples) {
+	if (samples.count == 0)
+		return;
 	auto &c = color(x,y);
-	float new_count = c.w + res.size();
-	vec3 avg(c);
-	c = vec4((vec3(c)*c.w + acc) / new_count, new_count);
+	float new_count = c.w + samples.count;
+	c = vec4((vec3(c)*c.w + samples.sum) / new_count, new_count);
 }
 
 
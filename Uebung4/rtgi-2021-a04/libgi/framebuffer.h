@@ -59,6 +59,7 @@ public:
 		color = buffer<vec4>(new_w, new_h);
 	}
 	void clear();
-	void add(unsigned x, unsigned y, gi_algorithm::sample_result res);
+	void add(unsigned x, unsigned y, const gi_algorithm::sample_result &res);
+	void add(unsigned x, unsigned y, const sample_sink &samples);
 	png::image<png::rgb_pixel> png() const;
 };
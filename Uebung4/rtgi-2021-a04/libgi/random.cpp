@@ -22,4 +22,9 @@ uint32_t rng::uniform_uint() const {
 vec2 rng::uniform_float2() const {
 	return {uniform_float(), uniform_float()};
 }
+
+void rng::seed(uint32_t a, uint32_t b) const {
+	std::seed_seq seq{a, b};
+	per_thread_rng[omp_get_thread_num()].seed(seq);
+}
  
@@ -22,4 +22,7 @@ public:
 	rng(rng &&other) = default;
 
 	vec2 uniform_float2() const;
+
+	//! Restart the generator of the calling thread from (a,b), e.g. per tile so that it does not matter which thread renders it
+	void seed(uint32_t a, uint32_t b) const;
 };
@@ -103,6 +103,11 @@ protected:
 public:
 	virtual triangle_intersection closest_hit(const ray &) = 0;
 	virtual bool any_hit(const ray &) = 0;
+	//! Closest hits of \c n rays at once, e.g. a chunk of a wavefront (default: one after the other)
+	virtual void closest_hit_stream(const ray *rays, triangle_intersection *closest, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			closest[i] = closest_hit(rays[i]);
+	}
 	virtual bool interprete(const std::string &command, std::istringstream &in) { return false; }
 };
 
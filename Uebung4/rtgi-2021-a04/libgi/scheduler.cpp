@@ -0,0 +1,176 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <omp.h>
+
+using namespace std;
+
+static inline uint64_t pack(uint32_t first, uint32_t end) { return (uint64_t(first) << 32) | end; }
+static inline uint32_t first_of(uint64_t r) { return uint32_t(r >> 32); }
+static inline uint32_t end_of(uint64_t r) { return uint32_t(r); }
+
+static uint64_t morton_key(uint32_t x, uint32_t y) {
+	uint64_t key = 0;
+	for (int b = 0; b < 16; ++b)
+		key |= (uint64_t((x >> b) & 1) << (2*b)) | (uint64_t((y >> b) & 1) << (2*b+1));
+	return key;
+}
+
+//! Position of (x,y) along the Hilbert curve through an n x n grid, n a power of two
+static uint64_t hilbert_key(uint32_t n, uint32_t x, uint32_t y) {
+	uint64_t key = 0;
+	for (uint32_t s = n/2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		key += uint64_t(s) * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s-1 - (x & (s-1));
+				y = s-1 - (y & (s-1));
+			}
+			std::swap(x, y);
+		}
+	}
+	return key;
+}
+
+void tile_scheduler::make_tiles(unsigned w, unsigned h) {
+	unsigned tx = (w + tile_size - 1) / tile_size;
+	unsigned ty = (h + tile_size - 1) / tile_size;
+	uint32_t n = 1;
+	while (n < max(tx, ty)) n *= 2;
+
+	vector<pair<uint64_t, tile>> keyed;
+	keyed.reserve(tx*ty);
+	for (unsigned y = 0; y < ty; ++y)
+		for (unsigned x = 0; x < tx; ++x) {
+			uint64_t key = y * tx + x;
+			if (tile_order == morton)       key = morton_key(x, y);
+			else if (tile_order == hilbert) key = hilbert_key(n, x, y);
+			keyed.push_back({key, tile{x*tile_size, y*tile_size, min(w, (x+1)*tile_size), min(h, (y+1)*tile_size), y*tx+x}});
+		}
+	sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+	tiles.resize(keyed.size());
+	for (size_t i = 0; i < keyed.size(); ++i)
+		tiles[i] = keyed[i].second;
+}
+
+//! Take the first tile of our own share
+bool tile_scheduler::pop(unsigned thread, uint32_t &t) {
+	auto &range = shares[thread].range;
+	uint64_t r = range.load(memory_order_relaxed);
+	while (first_of(r) < end_of(r))
+		if (range.compare_exchange_weak(r, pack(first_of(r)+1, end_of(r)), memory_order_acq_rel)) {
+			t = first_of(r);
+			return true;
+		}
+	return false;
+}
+
+/*! Take the back half of the first non-empty share of another thread.  The first of the stolen tiles is returned to be
+ *  run, the others become our own (empty) share.  Since a range only ever loses tiles from either end, and the tile at
+ *  the front of a range is always run when it is removed, a share cannot come back to a value a concurrent CAS still
+ *  expects.
+ */
+bool tile_scheduler::steal(unsigned thread, unsigned threads, uint32_t &t) {
+	for (unsigned i = 1; i < threads; ++i) {
+		auto &range = shares[(thread + i) % threads].range;
+		uint64_t r = range.load(memory_order_relaxed);
+		while (first_of(r) < end_of(r)) {
+			uint32_t first = first_of(r), end = end_of(r);
+			uint32_t mid = first + (end - first) / 2;
+			if (range.compare_exchange_weak(r, pack(first, mid), memory_order_acq_rel)) {
+				t = mid;
+				shares[thread].range.store(pack(mid+1, end), memory_order_release);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void tile_scheduler::run(unsigned w, unsigned h, const std::function<void(const tile &)> &fn) {
+	using namespace std::chrono;
+	make_tiles(w, h);
+	unsigned max_threads = omp_get_max_threads();
+	if (stats.size() < max_threads) stats.resize(max_threads);
+	if (shares.size() < max_threads) shares = vector<share>(max_threads);
+
+	#pragma omp parallel
+	{
+		auto start = steady_clock::now();
+		unsigned id = omp_get_thread_num();
+		unsigned threads = omp_get_num_threads();
+		uint32_t n = tiles.size();
+		shares[id].range.store(pack(uint64_t(n) * id / threads, uint64_t(n) * (id+1) / threads), memory_order_relaxed);
+		#pragma omp barrier
+
+		thread_stats &s = stats[id];
+		uint64_t busy = 0;
+		uint32_t t;
+		while (true) {
+			bool stolen = false;
+			if (!pop(id, t)) {
+				if (!steal(id, threads, t))
+					break;
+				stolen = true;
+			}
+			auto t0 = steady_clock::now();
+			fn(tiles[t]);
+			busy += duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+			s.tiles++;
+			s.stolen += stolen;
+		}
+		#pragma omp barrier
+		uint64_t total = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+		s.busy_ns += busy;
+		s.idle_ns += total - min(total, busy);
+	}
+}
+
+void tile_scheduler::clear_stats() {
+	for (auto &s : stats)
+		s = thread_stats();
+}
+
+std::string tile_scheduler::order_name(order o) {
+	switch (o) {
+	case scanline: return "scanline";
+	case morton:   return "morton";
+	case hilbert:  return "hilbert";
+	}
+	return "?";
+}
+
+void tile_scheduler::print_summary() const {
+	uint64_t busy = 0, idle = 0;
+	unsigned n = 0, stolen = 0;
+	for (auto &s : stats) {
+		busy += s.busy_ns;
+		idle += s.idle_ns;
+		n += s.tiles;
+		stolen += s.stolen;
+	}
+	if (n == 0) return;
+	stringstream line;
+	line << "Tiles: " << n << " of " << tile_size << "x" << tile_size << " (" << order_name(tile_order) << "), "
+	     << stolen << " stolen, threads idle " << fixed << setprecision(1) << 100.0 * idle / max(busy + idle, uint64_t(1))
+	     << "% of the time";
+	cout << line.str() << endl;
+}
+
+void tile_scheduler::print_stats() const {
+	stringstream table;
+	table << "thread     tiles    stolen     busy ms     idle ms" << endl;
+	table << fixed << setprecision(1);
+	for (size_t i = 0; i < stats.size(); ++i)
+		table << setw(6) << i << setw(10) << stats[i].tiles << setw(10) << stats[i].stolen
+		      << setw(12) << stats[i].busy_ns / 1e6 << setw(12) << stats[i].idle_ns / 1e6 << endl;
+	cout << table.str();
+	print_summary();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*  \brief Distributes the image in tiles over the OpenMP threads, idle threads steal work from busy ones.
+ *
+ *  The tiles are enumerated along a space-filling curve (see \ref order) and every thread starts out with a contiguous
+ *  piece of that sequence, so the tiles a thread renders are close to each other on screen.  A thread takes tiles from
+ *  the front of its share, when it runs out it steals the back half of another thread's share.  This balances frames
+ *  where some image regions are much more expensive than others (e.g. sky vs. interior), which a static schedule over
+ *  rows does not.
+ *
+ *  Which thread renders a tile depends on timing, so anything that should be reproducible must not depend on the
+ *  thread.  Each tile carries its row-major \c id for that, which does not change with the order or the number of
+ *  threads (see \ref recursive_algorithm::compute_samples, which seeds the random numbers per tile).
+ *
+ *  The usual structure for work stealing is a deque per thread that the owner pushes to and pops from at one end and
+ *  thieves take from the other.  Here all tiles are known before the frame starts and nothing is ever pushed, so a
+ *  thread's share can be a plain range [first,end) of the tile sequence.  Packed into 64 bit, taking the front tile and
+ *  stealing the back half are each a single CAS, there is no buffer to grow, and no pair of top/bottom indices that
+ *  needs fences between owner and thieves.  Stealing half a range also keeps the stolen tiles together on screen.
+ *
+ *  Busy time is the time spent in the tile function, idle time the rest of the time a thread spent in \ref run.  Both
+ *  accumulate until \ref clear_stats is called.
+ *
+ */
+struct tile_scheduler {
+	enum order { scanline, morton, hilbert };
+	unsigned tile_size = 16;
+	order tile_order = hilbert;
+
+	struct tile {
+		unsigned x0, y0, x1, y1;
+		uint32_t id;  // row-major position of the tile in the image, independent of the order
+	};
+
+	void run(unsigned w, unsigned h, const std::function<void(const tile &)> &fn);
+
+	//! Run \c fn(x, y) for each pixel of a w x h image, tile by tile
+	template<typename F> void for_each_pixel(unsigned w, unsigned h, const F &fn) {
+		run(w, h, [&](const tile &t) { for_each_pixel(t, fn); });
+	}
+	//! Run \c fn(x, y) for each pixel of the tile
+	template<typename F> static void for_each_pixel(const tile &t, const F &fn) {
+		for (unsigned y = t.y0; y < t.y1; ++y)
+			for (unsigned x = t.x0; x < t.x1; ++x)
+				fn(x, y);
+	}
+
+	struct alignas(64) thread_stats {
+		uint64_t busy_ns = 0, idle_ns = 0;
+		unsigned tiles = 0, stolen = 0;
+	};
+	std::vector<thread_stats> stats;
+
+	void clear_stats();
+	void print_summary() const;
+	void print_stats() const;
+
+	static std::string order_name(order o);
+
+private:
+	//! A thread's remaining tiles as [first,end) into \ref tiles, packed so that they can be taken with a single CAS
+	struct alignas(64) share {
+		std::atomic<uint64_t> range;
+	};
+	std::vector<tile> tiles;
+	std::vector<share> shares;
+	void make_tiles(unsigned w, unsigned h);
+	bool pop(unsigned thread, uint32_t &t);
+	bool steal(unsigned thread, unsigned threads, uint32_t &t);
+};
@@ -3,6 +3,11 @@
 #include "global-context.h"
 #include "context.h"
 #include "camera.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <vector>
+#include <iostream>
 
 namespace wf {
 
@@ -55,21 +60,78 @@ namespace wf {
 			}
 		};
 
+		/*! Batch tracing via an \ref individual_ray_tracer. Closest hits are computed in streams of \c stream_size rays
+		 *  (\ref individual_ray_tracer::closest_hit_stream), so tracers that traverse with many rays at once can
+		 *  amortize the memory traffic over the stream.
+		 *
+		 *  With \c reorder_rays the rays are first sorted by direction octant and the Morton code of their origin
+		 *  (relative to the scene bounds), traced in that order and the results scattered back. After a few bounces the
+		 *  rays in the wavefront are incoherent, sorting brings similar rays together in a stream again.
+		 */
 		class batch_rt_adapter : public batch_rt {
 		protected:
 			individual_ray_tracer *underlying_rt = nullptr;
+			std::vector<uint64_t> order;                // sort key in the upper, ray index in the lower 32 bit
+			std::vector<ray> sorted_rays;
+			std::vector<triangle_intersection> sorted_intersections;
+
+			void trace_streams(const ray *rays, triangle_intersection *intersections, int n) {
+				#pragma omp parallel for schedule(dynamic)
+				for (int first = 0; first < n; first += stream_size)
+					underlying_rt->closest_hit_stream(rays + first, intersections + first, std::min(n - first, int(stream_size)));
+			}
+			//! Spread the lower 10 bits of x to every third bit
+			static uint32_t spread_bits(uint32_t x) {
+				x &= 0x3ff;
+				x = (x | (x << 16)) & 0x030000ff;
+				x = (x | (x <<  8)) & 0x0300f00f;
+				x = (x | (x <<  4)) & 0x030c30c3;
+				x = (x | (x <<  2)) & 0x09249249;
+				return x;
+			}
+			//! Direction octant (3 bit) followed by the Morton code of the origin (3x9 bit), leaves 32 bit for the index
+			static uint64_t sort_key(const ray &ray, const aabb &bounds) {
+				vec3 rel = (ray.o - bounds.min) / glm::max(bounds.max - bounds.min, vec3(FLT_MIN));
+				glm::uvec3 cell = glm::uvec3(glm::clamp(rel, vec3(0), vec3(1)) * 511.0f);
+				uint32_t octant = (ray.d.x < 0) | (ray.d.y < 0) << 1 | (ray.d.z < 0) << 2;
+				return uint64_t(octant) << 27 | spread_bits(cell.x) | spread_bits(cell.y) << 1 | spread_bits(cell.z) << 2;
+			}
 		public:
+			unsigned stream_size = 1024;
+			bool reorder_rays = false;
 			batch_rt_adapter(individual_ray_tracer *underlying_rt) : underlying_rt(underlying_rt) {
 			}
 			~batch_rt_adapter() {
 				delete underlying_rt;
 			}
+			individual_ray_tracer* underlying() {
+				return underlying_rt;
+			}
 			void compute_closest_hit() override {
-				glm::ivec2 res = rc->resolution();	
+				glm::ivec2 res = rc->resolution();
+				int n = res.x*res.y;
+				if (!reorder_rays) {
+					trace_streams(rd.rays, rd.intersections, n);
+					return;
+				}
+				order.resize(n);
+				sorted_rays.resize(n);
+				sorted_intersections.resize(n);
+				{
+					time_this_block(reorder_rays);
+					const aabb &bounds = rc->scene.scene_bounds;
+					#pragma omp parallel for
+					for (int i = 0; i < n; ++i)
+						order[i] = sort_key(rd.rays[i], bounds) << 32 | uint32_t(i);
+					std::sort(order.begin(), order.end());
+					#pragma omp parallel for
+					for (int i = 0; i < n; ++i)
+						sorted_rays[i] = rd.rays[uint32_t(order[i])];
+				}
+				trace_streams(sorted_rays.data(), sorted_intersections.data(), n);
 				#pragma omp parallel for
-				for (int y = 0; y < res.y; ++y)
-					for (int x = 0; x < res.x; ++x)  // ray data missing
-						rd.intersections[y*res.x+x] = underlying_rt->closest_hit(rd.rays[y*res.x+x]);
+				for (int i = 0; i < n; ++i)
+					rd.intersections[uint32_t(order[i])] = sorted_intersections[i];
 			}
 			void compute_any_hit() override {
 				glm::ivec2 res = rc->resolution();	
@@ -81,6 +143,20 @@ namespace wf {
 			void build(::scene *s) override {
 				underlying_rt->build(s);
 			}
+			bool interprete(const std::string &command, std::istringstream &in) override {
+				if (command == "batch") {
+					std::string sub, value;
+					in >> sub >> value;
+					if (sub == "reorder" && (value == "on" || value == "off"))
+						reorder_rays = value == "on";
+					else if (sub == "stream-size" && std::atoi(value.c_str()) > 0)
+						stream_size = std::atoi(value.c_str());
+					else
+						std::cerr << "Syntax error, \"batch\" requires reorder on|off or stream-size <rays>" << std::endl;
+					return true;
+				}
+				return underlying_rt->interprete(command, in);
+			}
 		};
 
 		struct batch_ray_and_intersection_processing_cpu : public ray_and_intersection_processing {
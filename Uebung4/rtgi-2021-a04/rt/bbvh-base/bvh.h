@@ -68,11 +68,13 @@ struct binary_bvh_tracer : public individual_ray_tracer {
 	uint32_t root;
 	bool should_export = false;
 	uint32_t max_depth;
+	bool stream_traversal = true;  // closest_hit_stream traverses with all rays at once (off: ray by ray)
 	
 	binary_bvh_tracer();
 	void build(::scene *scene) override;
 	triangle_intersection closest_hit(const ray &ray) override;
 	bool any_hit(const ray &ray) override;
+	void closest_hit_stream(const ray *rays, triangle_intersection *closest, size_t n) override;
 	bool interprete(const std::string &command, std::istringstream &in) override;
 
 private:
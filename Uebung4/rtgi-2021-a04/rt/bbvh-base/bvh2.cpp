@@ -500,6 +500,87 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::any_hit(const ray &ray) {
 	return false;
 }
 
+/* Strom-Traversierung (Barringer, Akenine-Möller, "Dynamic Ray Stream Traversal", 2014)
+ *
+ * Alle Strahlen des Stroms laufen gemeinsam durch den Baum: zu jedem Knoten auf dem Stack gehört ein Abschnitt von ids
+ * mit den Strahlen, die seine Box treffen. Beim Abarbeiten eines inneren Knotens wird der Abschnitt in die Strahlen
+ * aufgeteilt, die das linke bzw. rechte Kind treffen (ein Strahl kann in beiden landen), zuerst besucht wird das Kind,
+ * das für die Mehrheit der Strahlen näher liegt. So wird jeder Knoten nur einmal pro Strom geladen, egal wie viele
+ * Strahlen ihn besuchen. Der oberste Abschnitt liegt immer am Ende von ids, der Speicher wird wie ein Stack benutzt.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+void binary_bvh_tracer<tr_layout, esc_mode>::closest_hit_stream(const ray *rays, triangle_intersection *closest, size_t n) {
+	time_this_block(closest_hit_stream);
+	if (!stream_traversal) {
+		for (size_t i = 0; i < n; ++i)
+			closest[i] = closest_hit(rays[i]);
+		return;
+	}
+	struct segment {
+		uint32_t node;
+		size_t begin, end;
+	};
+	std::vector<uint32_t> ids(n), left, right;
+	left.reserve(n);
+	right.reserve(n);
+	for (size_t i = 0; i < n; ++i) {
+		ids[i] = i;
+		closest[i] = triangle_intersection();
+	}
+	std::vector<segment> stack;
+	stack.push_back({ root, 0, n });
+	triangle_intersection intersection;
+	while (!stack.empty()) {
+		segment s = stack.back();
+		stack.pop_back();
+		const node &node = nodes[s.node];
+		if (node.inner()) {
+			left.clear();
+			right.clear();
+			int left_first = 0;
+			for (size_t k = s.begin; k < s.end; ++k) {
+				uint32_t i = ids[k];
+				float dist_l, dist_r;
+				bool hit_l = intersect4(node.box_l, rays[i], dist_l) && dist_l < closest[i].t;
+				bool hit_r = intersect4(node.box_r, rays[i], dist_r) && dist_r < closest[i].t;
+				if (hit_l) left.push_back(i);
+				if (hit_r) right.push_back(i);
+				if (hit_l && hit_r)
+					left_first += dist_l < dist_r ? 1 : -1;
+			}
+			ids.resize(s.begin);
+			auto push = [&](const std::vector<uint32_t> &sub, int32_t child) {
+				if (sub.empty())
+					return;
+				stack.push_back({ uint32_t(child), ids.size(), ids.size() + sub.size() });
+				ids.insert(ids.end(), sub.begin(), sub.end());
+			};
+			if (left_first >= 0) {
+				push(right, node.link_r);
+				push(left,  node.link_l);
+			}
+			else {
+				push(left,  node.link_l);
+				push(right, node.link_r);
+			}
+		}
+		else {
+			for (size_t k = s.begin; k < s.end; ++k) {
+				uint32_t i = ids[k];
+				for (int j = 0; j < node.tri_count(); ++j) {
+					int tri_idx = triangle_index(node.tri_offset()+j);
+					if (intersect(scene->triangles[tri_idx], scene->vertices.data(), rays[i], intersection))
+						if (intersection.t < closest[i].t) {
+							closest[i] = intersection;
+							closest[i].ref = tri_idx;
+						}
+				}
+			}
+			ids.resize(s.begin);
+		}
+	}
+}
+
 template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
 bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &command, std::istringstream &in) {
 	std::string value;
@@ -533,6 +614,14 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &comma
 			else error("Syntax error, \"bvh triangles\" requires a mode (single or multiple)");
 			return true;
 		}
+		else if (value == "stream") {
+			in >> value;
+			check_in_complete("Syntax error, \"bvh stream\" requires on or off");
+			if (value != "on" && value != "off")
+				error("Syntax error, \"bvh stream\" requires on or off");
+			stream_traversal = value == "on";
+			return true;
+		}
 		else if (value == "statistics") {
 			print_node_stats();
 			return true;
@@ -0,0 +1,88 @@
+/*
+ * 	Checks that rendering with the tile scheduler gives the same image for any number of threads and any tile order,
+ * 	that every pixel receives all of its samples, and that an algorithm written against the sample_result interface
+ * 	(sample_result_algorithm) renders the same image as one writing to the sample_sink.
+ *
+ * 	The algorithms only draw random numbers, so any change in how they are seeded or in which pixels are sampled shows
+ * 	up directly.  The exit code is the number of configurations that failed.
+ *
+ */
+#include "libgi/algorithm.h"
+#include "libgi/context.h"
+#include "libgi/global-context.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+using namespace std;
+using namespace glm;
+
+struct noise : public recursive_algorithm {
+	void sample_pixel(uint32_t x, uint32_t y, uint32_t samples, sample_sink &sink) override {
+		for (uint32_t i = 0; i < samples; ++i) {
+			float r = uniform_float();
+			float g = uniform_float();
+			vec2 pos = uniform_float2();
+			sink.add(vec3(r, g, float(x+y)), pos);
+		}
+	}
+};
+
+struct legacy_noise : public sample_result_algorithm {
+	sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples) override {
+		sample_result result;
+		for (uint32_t i = 0; i < samples; ++i) {
+			float r = uniform_float();
+			float g = uniform_float();
+			vec2 pos = uniform_float2();
+			result.push_back({vec3(r, g, float(x+y)), pos});
+		}
+		return result;
+	}
+};
+
+static vector<vec4> render(gi_algorithm &algo) {
+	rc->framebuffer.clear();
+	algo.compute_samples();
+	const auto &color = rc->framebuffer.color;
+	return vector<vec4>(color.data, color.data + color.w * color.h);
+}
+
+int main() {
+	rc->change_resolution(301, 199);
+	rc->sppx = 4;
+	noise sink_algo;
+	legacy_noise legacy_algo;
+
+	int failed = 0;
+	vector<vec4> reference;
+	int max_threads = omp_get_max_threads();
+	vector<int> thread_counts = {1};
+	while (thread_counts.back() < max_threads)
+		thread_counts.push_back(std::min(2*thread_counts.back(), max_threads));
+	for (int threads : thread_counts) {
+		for (auto order : {tile_scheduler::scanline, tile_scheduler::morton, tile_scheduler::hilbert}) {
+			omp_set_num_threads(threads);
+			rc->scheduler.tile_order = order;
+			vector<vec4> image = render(sink_algo), legacy = render(legacy_algo);
+			if (reference.empty())
+				reference = image;
+			string problem;
+			for (auto &c : image)
+				if (c.w != rc->sppx)
+					problem = "wrong sample count";
+			if (image != reference)
+				problem = "image differs";
+			if (legacy != image)
+				problem = "sample_result algorithm differs";
+			cout << (problem.empty() ? "ok   " : "FAIL ") << threads << " threads, " << tile_scheduler::order_name(order);
+			if (!problem.empty()) cout << " (" << problem << ")";
+			cout << endl;
+			failed += !problem.empty();
+		}
+	}
+	omp_set_num_threads(max_threads);
+	return failed;
+}
@@ -0,0 +1,154 @@
+/*
+ * 	Checks the batch tracing path (wf::cpu::batch_rt_adapter and the stream traversal of the bbvh) against the
+ * 	sequential reference (seq_tri_is).
+ *
+ * 	The wavefront looks like the ones the adapter sees when rendering: the upper half of the image holds coherent
+ * 	camera rays, the lower half incoherent bounce rays leaving the terrain.  It is traced with and without sorting the
+ * 	rays, with different stream sizes and with the stream traversal switched off, every closest hit has to match the
+ * 	reference.  The exit code is the number of configurations that did not.
+ *
+ */
+#include "libgi/scene.h"
+#include "libgi/context.h"
+#include "libgi/wavefront-rt.h"
+#include "libgi/global-context.h"
+
+#include "rt/seq/seq.h"
+#include "rt/bbvh-base/bvh.h"
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+static float height(float x, float z) {
+	return 3.0f * sinf(x * 0.2f) * cosf(z * 0.15f);
+}
+
+static void add_triangle(scene &s, vec3 a, vec3 b, vec3 c) {
+	uint32_t base = s.vertices.size();
+	for (vec3 p : {a, b, c}) {
+		vertex v;
+		v.pos = p;
+		v.norm = normalize(cross(b - a, c - a));
+		s.vertices.push_back(v);
+		s.scene_bounds.grow(p);
+	}
+	s.triangles.push_back({base, base+1, base+2, 0});
+}
+
+//! A hilly n x n terrain over [0,100]^2 with boxes of different sizes standing on it
+static void make_terrain(scene &s, int n) {
+	float step = 100.0f / n;
+	auto p = [&](int i, int j) { float x = i*step, z = j*step; return vec3(x, height(x, z), z); };
+	for (int j = 0; j < n; ++j)
+		for (int i = 0; i < n; ++i) {
+			add_triangle(s, p(i, j), p(i+1, j), p(i+1, j+1));
+			add_triangle(s, p(i, j), p(i+1, j+1), p(i, j+1));
+		}
+	mt19937 rng(5);
+	uniform_real_distribution<float> u(0, 1);
+	for (int b = 0; b < 40; ++b) {
+		vec3 size(1 + u(rng)*6, 1 + u(rng)*15, 1 + u(rng)*6);
+		vec3 lo(u(rng)*90, 0, u(rng)*90);
+		lo.y = height(lo.x, lo.z) - 1;
+		vec3 c[8];
+		for (int k = 0; k < 8; ++k)
+			c[k] = lo + size * vec3(k & 1, (k >> 1) & 1, (k >> 2) & 1);
+		int faces[6][4] = { {0,2,3,1}, {4,5,7,6}, {0,1,5,4}, {2,6,7,3}, {0,4,6,2}, {1,3,7,5} };
+		for (auto &f : faces) {
+			add_triangle(s, c[f[0]], c[f[1]], c[f[2]]);
+			add_triangle(s, c[f[0]], c[f[2]], c[f[3]]);
+		}
+	}
+}
+
+//! Camera rays over the upper half of the image, rays leaving the terrain in random directions over the lower half
+static vector<ray> make_wavefront(int w, int h) {
+	mt19937 rng(3);
+	uniform_real_distribution<float> u(0, 1);
+	vector<ray> rays(w*h);
+	vec3 eye(-20, 40, -20), target(50, 0, 50);
+	vec3 dir = normalize(target - eye), right = normalize(cross(dir, vec3(0, 1, 0))), up = cross(right, dir);
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x) {
+			ray &r = rays[y*w+x];
+			if (y < h/2) {
+				float sx = (x + 0.5f) / w - 0.5f, sy = (y + 0.5f) / (h/2) - 0.5f;
+				r = ray(eye, normalize(dir + sx * right + 0.5f * sy * up));
+			}
+			else {
+				vec3 o(u(rng)*100, 0, u(rng)*100);
+				o.y = height(o.x, o.z) + 0.01f;
+				vec3 d(u(rng)-0.5f, u(rng), u(rng)-0.5f);
+				r = ray(o, normalize(d));
+				if (x % 4 == 0)
+					r.length_exclusive(15);  // shadow ray towards a nearby light
+			}
+		}
+	return rays;
+}
+
+static bool same_hit(const triangle_intersection &expected, const triangle_intersection &hit) {
+	if (expected.valid() != hit.valid())
+		return false;
+	return !expected.valid() || fabs(expected.t - hit.t) <= 1e-4f * std::max(1.0f, expected.t);
+}
+
+template<bbvh_triangle_layout tr_layout>
+int check(const string &name, const vector<ray> &rays, const vector<triangle_intersection> &expected) {
+	auto *rt = new wf::cpu::batch_rt_adapter(new binary_bvh_tracer<tr_layout, bbvh_esc_mode::off>);
+	rc->scene.use(rt);
+	rt->build(&rc->scene);
+
+	auto command = [&](const string &line) {
+		istringstream in(line);
+		string cmd;
+		in >> cmd;
+		rt->interprete(cmd, in);
+	};
+	int failed = 0;
+	for (string stream : {"on", "off"})
+		for (string reorder : {"off", "on"})
+			for (string size : {"1", "64", "1024"}) {
+				command("bvh stream " + stream);
+				command("batch reorder " + reorder);
+				command("batch stream-size " + size);
+				copy(rays.begin(), rays.end(), rt->rd.rays);
+				rt->compute_closest_hit();
+				int bad = 0;
+				for (size_t i = 0; i < rays.size(); ++i)
+					if (!same_hit(expected[i], rt->rd.intersections[i]))
+						++bad;
+				cout << (bad ? "FAIL " : "ok   ") << name << ", stream " << stream << ", reorder " << reorder
+				     << ", stream size " << size;
+				if (bad) cout << " (" << bad << " mismatches)";
+				cout << endl;
+				failed += bad != 0;
+			}
+	rc->scene.use(nullptr);
+	return failed;
+}
+
+int main() {
+	rc->change_resolution(128, 96);
+	make_terrain(rc->scene, 48);
+	vector<ray> rays = make_wavefront(rc->w(), rc->h());
+
+	// The flat layout reorders the scene triangles, so only the distances are compared
+	seq_tri_is reference;
+	reference.build(&rc->scene);
+	vector<triangle_intersection> expected(rays.size());
+	#pragma omp parallel for
+	for (size_t i = 0; i < rays.size(); ++i)
+		expected[i] = reference.closest_hit(rays[i]);
+
+	int failed = 0;
+	failed += check<bbvh_triangle_layout::flat>("bbvh flat", rays, expected);
+	failed += check<bbvh_triangle_layout::indexed>("bbvh indexed", rays, expected);
+	return failed;
+}
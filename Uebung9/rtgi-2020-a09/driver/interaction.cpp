@@ -16,6 +16,8 @@
 
 #include "rt/seq/seq.h"
 #include "rt/bbvh-base/bvh.h"
+#include "rt/bbvh-base/wbvh.h"
+#include "rt/bbvh-base/tlbvh.h"
 #include "gi/primary-hit.h"
 #include "gi/direct.h"
 #include "gi/pt.h"
@@ -30,6 +32,7 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #endif
 #include <glm/gtx/string_cast.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 inline std::ostream& operator<<(std::ostream &out, const vec3 &x) {
 	out << to_string(x);
 	return out;
@@ -45,6 +48,31 @@ using namespace std;
 
 const char *prompt = "rtgi > ";
 
+template<bbvh_node_format format> static ray_tracer* make_bbvh(bool flat, bool esc) {
+	if (flat)
+		return new binary_bvh_tracer<bbvh_triangle_layout::flat, bbvh_esc_mode::off, format>;
+	else if (!esc)
+		return new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off, format>;
+	else
+		return new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on, format>;
+}
+
+/* Reads a sequence of "translate x y z", "rotate deg x y z" and "scale s", each applied after the previous ones.
+ */
+static bool read_trafo(istream &in, mat4 &trafo) {
+	trafo = mat4(1.0f);
+	string op;
+	while (in >> op) {
+		vec3 v;
+		float f;
+		if (op == "translate" && in >> v) trafo = translate(mat4(1.0f), v) * trafo;
+		else if (op == "rotate" && in >> f >> v) trafo = rotate(mat4(1.0f), radians(f), v) * trafo;
+		else if (op == "scale" && in >> f) trafo = scale(mat4(1.0f), vec3(f)) * trafo;
+		else return false;
+	}
+	return true;
+}
+
 #define ifcmd(c) if (command==c)
 #define error(x) { cerr << "command " << uc.cmdid << " (" << command << "): " << x << endl; continue; }
 #define check_in(x) { if (in.bad() || in.fail()) error(x); }
@@ -183,22 +211,56 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 			if (name == "seq") scene.rt = new seq_tri_is;
 			else if (name == "naive-bvh") scene.rt = new naive_bvh;
 			else if (name == "bbvh") {
-				string tag1, tag2;
-				in >> tag1 >> tag2;
+				string tag1, tag2, tag3, kernel;
+				in >> tag1 >> tag2 >> tag3;
 				bool flat = true;
 				bool esc = false;
+				bbvh_node_format format = bbvh_node_format::full;
+				// kernel=<box test>,<triangle test> (either may be left out), see "bvh kernel"
+				for (string *t : { &tag1, &tag2, &tag3 })
+					if (t->rfind("kernel=", 0) == 0) {
+						kernel = t->substr(7);
+						t->clear();
+					}
 				if (tag1 == "indexed" || tag2 == "indexed") flat = false;
 				if (tag1 == "esc" || tag2 == "esc") esc = true;
-				if (flat && !esc)
-					scene.rt = new binary_bvh_tracer<bbvh_triangle_layout::flat, bbvh_esc_mode::off>;
-				else if (!flat && !esc)
-					scene.rt = new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
-				else if (!flat && esc)
-					scene.rt = new binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
-				else if (flat && esc)
+				for (auto tag : { tag1, tag2, tag3 })
+					if (tag == "q16") format = bbvh_node_format::quantized16;
+					else if (tag == "q8") format = bbvh_node_format::quantized8;
+				if (flat && esc)
 					error("This combination is technically problematic")
+				if (!kernel.empty() && format != bbvh_node_format::full)
+					error("The intersection kernels can only be selected for full (unquantized) nodes");
+				if (format == bbvh_node_format::full)
+					scene.rt = make_bbvh<bbvh_node_format::full>(flat, esc);
+				else if (format == bbvh_node_format::quantized16)
+					scene.rt = make_bbvh<bbvh_node_format::quantized16>(flat, esc);
 				else
-					error("There is no such bbvh variant");
+					scene.rt = make_bbvh<bbvh_node_format::quantized8>(flat, esc);
+				if (!kernel.empty()) {
+					replace(kernel.begin(), kernel.end(), ',', ' ');
+					istringstream kernel_in("kernel " + kernel);
+					scene.rt->interprete("bvh", kernel_in);
+				}
+			}
+			else if (name == "two-level") scene.rt = new two_level_bvh_tracer;
+			else if (name == "bvh4" || name == "bvh8") {
+				string tag1, tag2;
+				in >> tag1 >> tag2;
+				bool flat = !(tag1 == "indexed" || tag2 == "indexed");
+				bool esc = tag1 == "esc" || tag2 == "esc";
+				bool four = name == "bvh4";
+				if (flat && esc)
+					error("This combination is technically problematic")
+				else if (flat)
+					scene.rt = four ? (ray_tracer*)new wide_bvh_tracer<4, bbvh_triangle_layout::flat, bbvh_esc_mode::off>
+					                : (ray_tracer*)new wide_bvh_tracer<8, bbvh_triangle_layout::flat, bbvh_esc_mode::off>;
+				else if (!esc)
+					scene.rt = four ? (ray_tracer*)new wide_bvh_tracer<4, bbvh_triangle_layout::indexed, bbvh_esc_mode::off>
+					                : (ray_tracer*)new wide_bvh_tracer<8, bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
+				else
+					scene.rt = four ? (ray_tracer*)new wide_bvh_tracer<4, bbvh_triangle_layout::indexed, bbvh_esc_mode::on>
+					                : (ray_tracer*)new wide_bvh_tracer<8, bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
 			}
 			else error("There is no ray tracer called '" << name << "'");
 			uc.tracer_touched_at = uc.cmdid;
@@ -208,8 +270,27 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 				error("There is no scene data to work with");
 			if (!scene.rt)
 				error("There is no ray traversal scheme to commit the scene data to");
+			if (!scene.instances.empty() && !dynamic_cast<two_level_bvh_tracer*>(scene.rt))
+				cerr << "WARNING: Instances are only placed by the two-level tracer" << endl;
+			bool accel_current = uc.accel_touched_at != 0 && uc.accel_touched_at > uc.scene_touched_at
+			                     && uc.accel_touched_at > uc.tracer_touched_at && uc.accel_touched_at > uc.tracer_config_touched_at;
 			scene.compute_light_distribution();
-			scene.rt->build(&scene);
+			if (accel_current)
+				cout << "Geometry did not change, only the light distribution was updated" << endl;
+			else
+				scene.rt->build(&scene);
+			uc.accel_touched_at = uc.cmdid;
+		}
+		else ifcmd("refit") {
+			if (uc.accel_touched_at == 0 || uc.accel_touched_at < uc.tracer_touched_at)
+				error("There is no acceleration structure to refit (use commit)");
+			scene.compute_light_distribution();
+			if (uc.accel_touched_at < uc.tracer_config_touched_at) {
+				cout << "The tracer was configured differently since the last build, building instead of refitting" << endl;
+				scene.rt->build(&scene);
+			}
+			else
+				scene.rt->refit();
 			uc.accel_touched_at = uc.cmdid;
 		}
 		else ifcmd("sppx") {
@@ -225,6 +306,8 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 				error("The current tracer does (might?) not have an up-to-date acceleration structure");
 			if (uc.accel_touched_at < uc.scene_touched_at)
 				error("The current acceleration structure is out-dated");
+			if (uc.accel_touched_at < uc.lights_touched_at)
+				error("The light distribution is out-dated (use commit)");
 			run(rc, algo);
 		}
 		else ifcmd("rt_bench") {
@@ -249,6 +332,45 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 			}
 			error("Meshes can only be listed in this version");
 		}
+		else ifcmd("instance") {
+			string cmd, name, object;
+			in >> cmd;
+			if (in.eof() && cmd == "list") {
+				for (auto &inst : scene.instances) cout << inst.name << " (" << scene.objects[inst.object].name << ")" << endl;
+				continue;
+			}
+			in >> name;
+			if (cmd == "add")
+				in >> object;
+			check_in("Syntax error, requires add <name> <object> [trafo], move <name> [trafo] or list");
+			mat4 trafo;
+			if (!read_trafo(in, trafo))
+				error("Syntax error, the transformation is a sequence of translate x y z, rotate deg x y z and scale s");
+			int placed = 0;
+			if (cmd == "add") {
+				// An object loaded with a name is addressed by the name as well (covering all of its meshes)
+				for (unsigned i = 0; i < scene.objects.size(); ++i)
+					if (scene.objects[i].name == object || scene.objects[i].name.rfind(object + "/", 0) == 0) {
+						scene.instances.push_back({ name, i });
+						scene.instances.back().place(trafo);
+						placed++;
+					}
+				if (placed == 0)
+					error("There is no object called '" << object << "' (see mesh list)");
+			}
+			else if (cmd == "move") {
+				for (auto &inst : scene.instances)
+					if (inst.name == name) {
+						inst.place(trafo);
+						placed++;
+					}
+				if (placed == 0)
+					error("There is no instance called '" << name << "'");
+			}
+			else
+				error("Syntax error, requires add <name> <object> [trafo], move <name> [trafo] or list");
+			uc.scene_touched_at = uc.cmdid;
+		}
 		else ifcmd("material") {
 			string cmd;
 			in >> cmd;
@@ -278,6 +400,7 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 				in >> tmp;
 				check_in_complete("Expects a color triplet");
 				mat->emissive = tmp;
+				uc.lights_touched_at = uc.cmdid;
 			}
 			else ifcmd("roughness") {
 				in >> tmp.x;
@@ -430,7 +553,11 @@ void repl(istream &infile, render_context &rc, repl_update_checks &uc) {
 		else if (command == "") ;
 		else if (command[0] == '#') ;
 		else if (algo && algo->interprete(command, in)) ;
-		else if (scene.rt && scene.rt->interprete(command, in)) ;
+		else if (scene.rt && scene.rt->interprete(command, in)) {
+			if (scene.rt->build_settings_changed)
+				uc.tracer_config_touched_at = uc.cmdid;
+			scene.rt->build_settings_changed = false;
+		}
 		else {
 			error("Unknown command");
 		}
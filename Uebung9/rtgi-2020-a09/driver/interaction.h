@@ -13,6 +13,8 @@ struct repl_update_checks {
 	unsigned cmdid = 0,
 			 scene_touched_at = 0,
 			 tracer_touched_at = 0,
+			 tracer_config_touched_at = 0,  // tracer commands that change how the bvh is built
+			 lights_touched_at = 0,         // material edits that change the light distribution only
 			 accel_touched_at = 0;
 };
 
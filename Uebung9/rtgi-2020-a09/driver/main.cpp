@@ -48,6 +48,42 @@ std::string timediff(unsigned ms) {
 	else return std::to_string(ms) + " ms";
 }
 
+/*! \brief Accumulate \c samples samples for each pixel
+ *
+ *  Algorithms that start from primary hits (\ref gi_algorithm::uses_primary_hits) get the camera rays of each tile of
+ *  ray_packet::width x ray_packet::height pixels traced together as one \ref ray_packet, all others are sampled pixel
+ *  by pixel.
+ */
+void render_samples(render_context &rc, gi_algorithm *algo, unsigned samples) {
+	if (!algo->uses_primary_hits()) {
+		rc.framebuffer.color.for_each([&](unsigned x, unsigned y) {
+											rc.framebuffer.add(x, y, algo->sample_pixel(x, y, samples, rc));
+										});
+		return;
+	}
+	const camera &cam = rc.scene.camera;
+	const int tiles_x = (cam.w + ray_packet::width - 1) / ray_packet::width;
+	const int tiles_y = (cam.h + ray_packet::height - 1) / ray_packet::height;
+	#pragma omp parallel for schedule(dynamic)
+	for (int tile = 0; tile < tiles_x*tiles_y; ++tile) {
+		unsigned x0 = (tile % tiles_x) * ray_packet::width, y0 = (tile / tiles_x) * ray_packet::height;
+		unsigned w = std::min(ray_packet::width, cam.w - x0), h = std::min(ray_packet::height, cam.h - y0);
+		ray_packet packet;
+		packet.n = w*h;
+		triangle_intersection closest[ray_packet::size];
+		gi_algorithm::sample_result result[ray_packet::size];
+		for (unsigned sample = 0; sample < samples; ++sample) {
+			for (unsigned i = 0; i < packet.n; ++i)
+				packet.rays[i] = cam_ray(cam, x0 + i%w, y0 + i/w, vec2(rc.rng.uniform_float()-0.5f, rc.rng.uniform_float()-0.5f));
+			rc.scene.rt->closest_hit_packet(packet, closest);
+			for (unsigned i = 0; i < packet.n; ++i)
+				result[i].push_back({algo->sample_primary_hit(packet.rays[i], closest[i], rc), vec2(0)});
+		}
+		for (unsigned i = 0; i < packet.n; ++i)
+			rc.framebuffer.add(x0 + i%w, y0 + i/w, result[i]);
+	}
+}
+
 /*! \brief This is called from the \ref repl to compute a single image
  *  
  *  Note: We first compute a single sample to get a rough estimate of how long rendering is going to take.
@@ -63,15 +99,11 @@ void run(render_context &rc, gi_algorithm *algo) {
 	rc.framebuffer.clear();
 
 	auto start = system_clock::now();
-	rc.framebuffer.color.for_each([&](unsigned x, unsigned y) {
-										rc.framebuffer.add(x, y, algo->sample_pixel(x, y, 1, rc));
-    								});
+	render_samples(rc, algo, 1);
 	auto delta_ms = duration_cast<milliseconds>(system_clock::now() - start).count();
 	cout << "Will take around " << timediff(delta_ms*(rc.sppx-1)) << " to complete" << endl;
 	
-	rc.framebuffer.color.for_each([&](unsigned x, unsigned y) {
-										rc.framebuffer.add(x, y, algo->sample_pixel(x, y, rc.sppx-1, rc));
-    								});
+	render_samples(rc, algo, rc.sppx-1);
 	delta_ms = duration_cast<milliseconds>(system_clock::now() - start).count();
 	cout << "Took " << timediff(delta_ms) << " (" << delta_ms << " ms) " << " to complete" << endl;
 	
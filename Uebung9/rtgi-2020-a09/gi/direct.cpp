@@ -13,33 +13,37 @@ using namespace std;
 gi_algorithm::sample_result direct_light::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &rc) {
 	sample_result result;
 	for (int sample = 0; sample < samples; ++sample) {
-		vec3 radiance(0,0,0);
 		ray view_ray = cam_ray(rc.scene.camera, x, y, glm::vec2(rc.rng.uniform_float()-0.5f, rc.rng.uniform_float()-0.5f));
 		triangle_intersection closest = rc.scene.rt->closest_hit(view_ray);
-		if (closest.valid()) {
-			diff_geom dg(closest, rc.scene);
-			flip_normals_to_ray(dg, view_ray);
+		result.push_back({sample_primary_hit(view_ray, closest, rc),vec2(0)});
+	}
+	return result;
+}
 
-			if (dg.mat->emissive != vec3(0)) {
-				radiance = dg.mat->emissive;
-			}
-			else {
-				brdf *brdf = dg.mat->brdf;
-				//auto col = dg.mat->albedo_tex ? dg.mat->albedo_tex->sample(dg.tc) : dg.mat->albedo;
-				if      (sampling_mode == sample_uniform)   radiance = sample_uniformly(dg, view_ray);
-				else if (sampling_mode == sample_light)     radiance = sample_lights(dg, view_ray);
-				else if (sampling_mode == sample_cosine)    radiance = sample_cosine_weighted(dg, view_ray);
-				else if (sampling_mode == sample_brdf)      radiance = sample_brdfs(dg, view_ray);
-			}
+vec3 direct_light::sample_primary_hit(const ray &view_ray, const triangle_intersection &closest, const render_context &rc) {
+	vec3 radiance(0,0,0);
+	if (closest.valid()) {
+		diff_geom dg(closest, rc.scene);
+		flip_normals_to_ray(dg, view_ray);
+
+		if (dg.mat->emissive != vec3(0)) {
+			radiance = dg.mat->emissive;
 		}
+		else {
+			brdf *brdf = dg.mat->brdf;
+			//auto col = dg.mat->albedo_tex ? dg.mat->albedo_tex->sample(dg.tc) : dg.mat->albedo;
+			if      (sampling_mode == sample_uniform)   radiance = sample_uniformly(dg, view_ray);
+			else if (sampling_mode == sample_light)     radiance = sample_lights(dg, view_ray);
+			else if (sampling_mode == sample_cosine)    radiance = sample_cosine_weighted(dg, view_ray);
+			else if (sampling_mode == sample_brdf)      radiance = sample_brdfs(dg, view_ray);
+		}
+	}
 #ifdef RTGI_WITH_SKY
-		else
-			if (rc.scene.sky)
-				radiance = rc.scene.sky->Le(view_ray);
+	else
+		if (rc.scene.sky)
+			radiance = rc.scene.sky->Le(view_ray);
 #endif
-		result.push_back({radiance,vec2(0)});
-	}
-	return result;
+	return radiance;
 }
 
 vec3 direct_light::sample_uniformly(const diff_geom &hit, const ray &view_ray) {
@@ -17,6 +17,8 @@ protected:
 public:
 	direct_light(const render_context &rc) : gi_algorithm(rc) {}
 	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &r) override;
+	bool uses_primary_hits() const override { return true; }
+	vec3 sample_primary_hit(const ray &view_ray, const triangle_intersection &closest, const render_context &rc) override;
 	bool interprete(const std::string &command, std::istringstream &in) override;
 };
 
@@ -24,5 +26,7 @@ class direct_light_mis : public direct_light {
 public:
 	direct_light_mis(const render_context &rc) : direct_light(rc) {}
 	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &r) override;
+	// alternates between light and brdf samples over the samples of a pixel, which a single primary hit does not know
+	bool uses_primary_hits() const override { return false; }
 	bool interprete(const std::string &command, std::istringstream &in) override;
 };
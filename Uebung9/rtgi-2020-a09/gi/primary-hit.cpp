@@ -12,19 +12,23 @@ using namespace std;
 gi_algorithm::sample_result primary_hit_display::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &rc) {
 	sample_result result;
 	for (int sample = 0; sample < samples; ++sample) {
-		vec3 radiance(0);
 		ray view_ray = cam_ray(rc.scene.camera, x, y, glm::vec2(rc.rng.uniform_float()-0.5f, rc.rng.uniform_float()-0.5f));
 		triangle_intersection closest = rc.scene.rt->closest_hit(view_ray);
-		if (closest.valid()) {
-			diff_geom dg(closest, rc.scene);
-			// radiance = dg.albedo();
-			radiance = dg.mat->albedo;
-		}
-		result.push_back({radiance,vec2(0)});
+		result.push_back({sample_primary_hit(view_ray, closest, rc),vec2(0)});
 	}
 	return result;
 }
 
+vec3 primary_hit_display::sample_primary_hit(const ray &, const triangle_intersection &closest, const render_context &rc) {
+	vec3 radiance(0);
+	if (closest.valid()) {
+		diff_geom dg(closest, rc.scene);
+		// radiance = dg.albedo();
+		radiance = dg.mat->albedo;
+	}
+	return radiance;
+}
+
 gi_algorithm::sample_result local_illumination::sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &rc) {
 	sample_result result;
 	for (int sample = 0; sample < samples; ++sample) {
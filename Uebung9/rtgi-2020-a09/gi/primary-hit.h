@@ -14,6 +14,8 @@ class primary_hit_display : public gi_algorithm {
 public:
 	primary_hit_display(const render_context &rc) : gi_algorithm(rc) {}
 	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &r) override;
+	bool uses_primary_hits() const override { return true; }
+	vec3 sample_primary_hit(const ray &view_ray, const triangle_intersection &closest, const render_context &rc) override;
 };
 
 class local_illumination : public gi_algorithm {
@@ -46,14 +46,18 @@ gi_algorithm::sample_result simple_pt::sample_pixel(uint32_t x, uint32_t y, uint
 	return result;
 }
 
-vec3 simple_pt::path(ray ray) {
+vec3 simple_pt::sample_primary_hit(const ray &view_ray, const triangle_intersection &closest, const render_context &) {
+	return path(view_ray, &closest);
+}
+
+vec3 simple_pt::path(ray ray, const triangle_intersection *primary) {
 	time_this_block(pathtrace);
 	vec3 radiance(0);
 	vec3 throughput(1);
 	for (int i = 0; i < max_path_len; ++i) {
 		
 		// find hitpoint with scene
-		triangle_intersection closest = rc.scene.rt->closest_hit(ray);
+		triangle_intersection closest = (i == 0 && primary) ? *primary : rc.scene.rt->closest_hit(ray);
 		if (!closest.valid()) {
 			if (rc.scene.sky)
 				radiance = throughput * rc.scene.sky->Le(ray);
@@ -140,14 +144,14 @@ bool simple_pt::interprete(const std::string &command, std::istringstream &in) {
 // ----------------------- pt with next event estimation -----------------------
 //
 
-vec3 pt_nee::path(ray ray) {
+vec3 pt_nee::path(ray ray, const triangle_intersection *primary) {
 	vec3 radiance(0);
 	vec3 throughput(1);
 	float brdf_pdf = 0;
 	for (int i = 0; i < max_path_len; ++i) {
 		record_ray(i, ray);
 		// find hitpoint with scene
-		triangle_intersection closest = rc.scene.rt->closest_hit(ray);
+		triangle_intersection closest = (i == 0 && primary) ? *primary : rc.scene.rt->closest_hit(ray);
 		if (!closest.valid()) {
 			if (rc.scene.sky)
 				if (!mis || i==0)
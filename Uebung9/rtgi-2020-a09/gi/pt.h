@@ -9,16 +9,19 @@ protected:
 	int rr_start = 2;  // start RR after this many unrestricted bounces
 	enum class bounce { uniform, cosine, brdf } bounce = bounce::brdf;
 
-	virtual vec3 path(ray view_ray);
+	//! Trace a path starting with \c view_ray, its closest hit is computed unless given as \c primary
+	virtual vec3 path(ray view_ray, const triangle_intersection *primary = nullptr);
 	std::tuple<ray,float> bounce_ray(const diff_geom &dg, const ray &to_hit);
 public:
 	simple_pt(const render_context &rc) : gi_algorithm(rc) {}
 	gi_algorithm::sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &r) override;
+	bool uses_primary_hits() const override { return true; }
+	vec3 sample_primary_hit(const ray &view_ray, const triangle_intersection &closest, const render_context &rc) override;
 	bool interprete(const std::string &command, std::istringstream &in) override;
 };
 
 class pt_nee : public simple_pt {
-	vec3 path(ray view_ray) override;
+	vec3 path(ray view_ray, const triangle_intersection *primary = nullptr) override;
 	std::tuple<ray,vec3,float> sample_light(const diff_geom &hit);
 	bool mis = true;
 // 	bool mis = false;
@@ -44,6 +44,12 @@ public:
 	virtual void prepare_frame(const render_context &rc) {}
 	virtual void finalize_frame() {}
 	virtual sample_result sample_pixel(uint32_t x, uint32_t y, uint32_t samples, const render_context &rc) = 0;
+	/*! Algorithms whose samples start with the closest hit of a camera ray can return true here and implement
+	 *  sample_primary_hit, the render loop then traces the camera rays tile by tile as \ref ray_packet instead of
+	 *  calling sample_pixel.
+	 */
+	virtual bool uses_primary_hits() const { return false; }
+	virtual vec3 sample_primary_hit(const ray &, const triangle_intersection &, const render_context &) { return vec3(0); }
 	virtual ~gi_algorithm(){}
 };
 
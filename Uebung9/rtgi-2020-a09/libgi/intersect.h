@@ -2,6 +2,8 @@
 
 #include "rt.h"
 
+#include <limits>
+
 struct aabb {
 	vec3 min, max;
 	aabb() : min(FLT_MAX), max(-FLT_MAX) {}
@@ -15,6 +17,118 @@ struct aabb {
 	}
 };
 
+/*! Intersection-ready copy of a triangle: its first vertex and the two edges leaving it.
+ *  Holds everything the test below needs, so it can be read without going through the triangle's vertex indices.
+ */
+struct triangle_record {
+	vec3 a, e1, e2;
+	triangle_record() {}
+	triangle_record(const vec3 &a, const vec3 &b, const vec3 &c) : a(a), e1(b-a), e2(c-a) {}
+};
+
+// See Möller and Trumbore, Fast, Minimum Storage Ray/Triangle Intersection (1997). Same conventions as below.
+inline bool intersect(const triangle_record &tri, const ray &ray, triangle_intersection &info) {
+	vec3 p = cross(ray.d, tri.e2);
+	float inv_det = 1.0f / dot(tri.e1, p);
+	vec3 s = ray.o - tri.a;
+	float beta = dot(s, p) * inv_det;
+	if (!(beta > 0))
+		return false;
+	vec3 q = cross(s, tri.e1);
+	float gamma = dot(ray.d, q) * inv_det;
+	if (!(gamma > 0 && beta + gamma <= 1))
+		return false;
+	float tt = dot(tri.e2, q) * inv_det;
+	if (tt > ray.t_min && tt < ray.t_max) {
+		info.t = tt;
+		info.beta = beta;
+		info.gamma = gamma;
+		return true;
+	}
+	return false;
+}
+
+/*! Baldwin and Weber, Fast Ray-Triangle Intersections by Coordinate Transformation (2016).
+ *  Stores the affine map into the space where the triangle is the unit triangle in the xy plane, only its three rows
+ *  are needed: the first two give the barycentric coordinates of a point, the third its distance to the plane.
+ *  Rows are scaled by the largest component of the normal, degenerate triangles get NaN rows and are never hit.
+ */
+struct baldwin_weber_record {
+	vec3 row[3];
+	float offset[3];
+	baldwin_weber_record() {}
+	baldwin_weber_record(const vec3 &a, const vec3 &b, const vec3 &c) {
+		vec3 e1 = b - a, e2 = c - a, n = cross(e1, e2);
+		vec3 m = abs(n);
+		if (m.x > m.y && m.x > m.z) {
+			row[0] = vec3(0, e2.z, -e2.y) / n.x;
+			row[1] = vec3(0, -e1.z, e1.y) / n.x;
+			row[2] = n / n.x;
+		}
+		else if (m.y > m.z) {
+			row[0] = vec3(-e2.z, 0, e2.x) / n.y;
+			row[1] = vec3(e1.z, 0, -e1.x) / n.y;
+			row[2] = n / n.y;
+		}
+		else if (n.z != 0) {
+			row[0] = vec3(e2.y, -e2.x, 0) / n.z;
+			row[1] = vec3(-e1.y, e1.x, 0) / n.z;
+			row[2] = n / n.z;
+		}
+		else
+			row[0] = row[1] = row[2] = vec3(std::numeric_limits<float>::quiet_NaN());
+		for (int i = 0; i < 3; ++i)
+			offset[i] = -dot(row[i], a);
+	}
+};
+
+inline bool intersect(const baldwin_weber_record &tri, const ray &ray, triangle_intersection &info) {
+	float t = -(dot(tri.row[2], ray.o) + tri.offset[2]) / dot(tri.row[2], ray.d);
+	if (!(t > ray.t_min && t < ray.t_max))
+		return false;
+	vec3 p = ray.o + t * ray.d;
+	float beta = dot(tri.row[0], p) + tri.offset[0];
+	float gamma = dot(tri.row[1], p) + tri.offset[1];
+	if (!(beta > 0 && gamma > 0 && beta + gamma <= 1))
+		return false;
+	info.t = t;
+	info.beta = beta;
+	info.gamma = gamma;
+	return true;
+}
+
+/*! Woop, Benthin and Wald, Watertight Ray/Triangle Intersection (2013).
+ *  The vertices are sheared into a space where the ray runs along +z from the origin (the shear is prepared with the
+ *  ray), the 2D edge tests there have no gaps between triangles sharing an edge. Edges that pass exactly through the
+ *  ray are re-evaluated in double.
+ */
+inline bool intersect_watertight(const vec3 &a, const vec3 &b, const vec3 &c, const ray &ray, triangle_intersection &info) {
+	int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	float sx = ray.shear.x, sy = ray.shear.y, sz = ray.shear.z;
+	vec3 pa = a - ray.o, pb = b - ray.o, pc = c - ray.o;
+	float ax = pa[kx] - sx*pa[kz], ay = pa[ky] - sy*pa[kz];
+	float bx = pb[kx] - sx*pb[kz], by = pb[ky] - sy*pb[kz];
+	float cx = pc[kx] - sx*pc[kz], cy = pc[ky] - sy*pc[kz];
+	float u = cx*by - cy*bx, v = ax*cy - ay*cx, w = bx*ay - by*ax;
+	if (u == 0 || v == 0 || w == 0) {
+		u = float(double(cx)*double(by) - double(cy)*double(bx));
+		v = float(double(ax)*double(cy) - double(ay)*double(cx));
+		w = float(double(bx)*double(ay) - double(by)*double(ax));
+	}
+	if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		return false;
+	float det = u + v + w;
+	if (det == 0)
+		return false;
+	float t = (u*pa[kz] + v*pb[kz] + w*pc[kz]) * sz / det;
+	if (!(t > ray.t_min && t < ray.t_max))
+		return false;
+	info.t = t;
+	info.beta = v / det;
+	info.gamma = w / det;
+	return true;
+}
+
 // See Shirley (2nd Ed.), pp. 206. (library or excerpt online)
 inline bool intersect(const triangle &t, const vertex *vertices, const ray &ray, triangle_intersection &info) {
 	vec3 pos = vertices[t.a].pos;
@@ -201,26 +315,17 @@ inline bool intersect3(const aabb &box, const ray &ray, float &is) {
 	return true;
 }
 
+// Near and far plane of each slab follow from the signs of the ray direction, no distances have to be swapped
 inline bool intersect4(const aabb &box, const ray &ray, float &is) {
-		
-	float idx = ray.id.x;
-	float idy = ray.id.y;
-	float idz = ray.id.z;
 
-	float t1x_tmp = (box.min.x - ray.o.x) * idx;
-	float t2x_tmp = (box.max.x - ray.o.x) * idx;
-	float t1x = (t1x_tmp < t2x_tmp) ? t1x_tmp : t2x_tmp;
-	float t2x = (t2x_tmp < t1x_tmp) ? t1x_tmp : t2x_tmp;
+	float t1x = (ray.sign[0] ? box.max.x : box.min.x) * ray.id.x - ray.oid.x;
+	float t2x = (ray.sign[0] ? box.min.x : box.max.x) * ray.id.x - ray.oid.x;
 
-	float t1y_tmp = (box.min.y - ray.o.y) * idy;
-	float t2y_tmp = (box.max.y - ray.o.y) * idy;
-	float t1y = (t1y_tmp < t2y_tmp) ? t1y_tmp : t2y_tmp;
-	float t2y = (t2y_tmp < t1y_tmp) ? t1y_tmp : t2y_tmp;
+	float t1y = (ray.sign[1] ? box.max.y : box.min.y) * ray.id.y - ray.oid.y;
+	float t2y = (ray.sign[1] ? box.min.y : box.max.y) * ray.id.y - ray.oid.y;
 
-	float t1z_tmp = (box.min.z - ray.o.z) * idz;
-	float t2z_tmp = (box.max.z - ray.o.z) * idz;
-	float t1z = (t1z_tmp < t2z_tmp) ? t1z_tmp : t2z_tmp;
-	float t2z = (t2z_tmp < t1z_tmp) ? t1z_tmp : t2z_tmp;
+	float t1z = (ray.sign[2] ? box.max.z : box.min.z) * ray.id.z - ray.oid.z;
+	float t2z = (ray.sign[2] ? box.min.z : box.max.z) * ray.id.z - ray.oid.z;
 
 	float t1 = (t1x < t1y) ? t1y : t1x;
 	      t1 = (t1z < t1 ) ? t1  : t1z;
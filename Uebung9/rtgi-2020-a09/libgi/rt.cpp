@@ -16,8 +16,8 @@ diff_geom::diff_geom(const vertex &a, const vertex &b, const vertex &c,
 }
 
 diff_geom::diff_geom(const triangle &t, const triangle_intersection &is, const scene &scene)
- : diff_geom(scene.vertices[t.a], scene.vertices[t.b], scene.vertices[t.c],
-			 &scene.materials[t.material_id], is, scene) {
+ : diff_geom(scene.instanced_vertex(t.a, is.instance), scene.instanced_vertex(t.b, is.instance),
+			 scene.instanced_vertex(t.c, is.instance), &scene.materials[t.material_id], is, scene) {
 }
 
 diff_geom::diff_geom(const triangle_intersection &is, const scene &scene)
@@ -3,6 +3,8 @@
 #include <glm/glm.hpp>
 #include <utility>
 #include <string>
+#include <cmath>
+#include <cstdint>
 
 using glm::vec3;
 using glm::vec2;
@@ -16,15 +18,52 @@ constexpr float one_over_2pi = (1.0 / (2*M_PI));
 constexpr float one_over_4pi = (1.0 / (4*M_PI));
 
 
+/*  \brief A ray, prepared for traversal when it is constructed
+ *
+ *  Besides origin and direction it holds what box and triangle tests would otherwise recompute per node:
+ *  - id, the inverse direction. Components of d close to zero give large finite values instead of infinity, so that
+ *    oid = o*id stays finite and a slab plane p is hit at p*id - oid.
+ *  - sign, 1 for negative components of d. Such an axis enters a box at its max, not at its min.
+ *  - kx, ky, kz and shear for the watertight triangle test (see intersect_watertight): kz is the dominant axis of d,
+ *    shear maps d onto +z.
+ *  Origin and direction must therefore not be changed after construction.
+ */
 struct ray {
 	static constexpr float eps = 1e-4f;
 	vec3 o, d, id;
 	float t_min = eps, t_max = FLT_MAX;
-	ray(const vec3 &o, const vec3 &d) : o(o), d(d), id(1.0f/d.x, 1.0f/d.y, 1.0f/d.z) {}
+	vec3 oid;
+	uint8_t sign[3];
+	uint8_t kx, ky, kz;
+	vec3 shear;
+	ray(const vec3 &o, const vec3 &d) : o(o), d(d) {
+		for (int i = 0; i < 3; ++i) {
+			id[i] = 1.0f / (std::fabs(d[i]) < 1e-20f ? std::copysign(1e-20f, d[i]) : d[i]);
+			sign[i] = std::signbit(d[i]);
+		}
+		oid = o * id;
+		vec3 m = glm::abs(d);
+		kz = m.x > m.y ? (m.x > m.z ? 0 : 2) : (m.y > m.z ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (d[kz] < 0)
+			std::swap(kx, ky);
+		shear = vec3(d[kx] / d[kz], d[ky] / d[kz], 1.0f / d[kz]);
+	}
 	ray() {}
 	void length_exclusive(float d) { t_max = d - eps; }
 };
 
+/*  \brief A tile of coherent rays, e.g. the camera rays of 8x8 pixels, see \ref ray_tracer::closest_hit_packet
+ *
+ *  Rays are stored row by row, tiles at the image border use only the first n entries.
+ */
+struct ray_packet {
+	static constexpr unsigned width = 8, height = 8, size = width*height;
+	ray rays[size];
+	unsigned n = 0;
+};
+
 struct vertex {
 	vec3 pos;
 	vec3 norm;
@@ -38,11 +77,13 @@ struct triangle {
 
 struct triangle_intersection {
 	typedef unsigned int uint;
+	static constexpr uint no_instance = (uint)-1;
 	float t, beta, gamma;
 	uint ref;
-	triangle_intersection() : t(FLT_MAX), ref(0) {
+	uint instance;  // index into scene::instances if an instance was hit (only the two-level bvh reports these)
+	triangle_intersection() : t(FLT_MAX), ref(0), instance(no_instance) {
 	}
-	triangle_intersection(uint t) : t(FLT_MAX), ref(t) {
+	triangle_intersection(uint t) : t(FLT_MAX), ref(t), instance(no_instance) {
 	}
 	bool valid() const {
 		return t != FLT_MAX;
@@ -50,6 +91,7 @@ struct triangle_intersection {
 	void reset() {
 		t = FLT_MAX;
 		ref = 0;
+		instance = no_instance;
 	}
 	vec3 barycentric_coord() const {
 		vec3 bc;
@@ -92,8 +134,17 @@ protected:
 	::scene *scene;
 public:
 	virtual void build(::scene *) = 0;
+	//! Update the acceleration structure after vertex positions changed, keeping its topology (default: rebuild)
+	virtual void refit() { build(scene); }
 	virtual triangle_intersection closest_hit(const ray &) = 0;
 	virtual bool any_hit(const ray &) = 0;
+	//! Closest hits of all rays of the packet (default: one after the other)
+	virtual void closest_hit_packet(const ray_packet &packet, triangle_intersection *closest) {
+		for (unsigned i = 0; i < packet.n; ++i)
+			closest[i] = closest_hit(packet.rays[i]);
+	}
 	virtual bool interprete(const std::string &command, std::istringstream &in) { return false; }
+	//! Set by interprete if the command changed how the acceleration structure is built (reset by the repl)
+	bool build_settings_changed = false;
 	virtual ~ray_tracer() {}
 };
@@ -98,6 +98,7 @@ void scene::add(const filesystem::path& path, const std::string &name, const mat
         throw std::runtime_error("ERROR: Failed to load file: " + path.string() + "!");
 
 	// todo: store indices prior to adding anything to allow "transform-last"
+	mat3 normal_trafo = transpose(inverse(mat3(trafo)));
 
 	// initialize brdfs
 	if (brdfs.empty() || brdfs.count("default") == 0) {
@@ -147,14 +148,13 @@ void scene::add(const filesystem::path& path, const std::string &name, const mat
 		uint32_t material_id = scene_ai->mMeshes[i]->mMaterialIndex + material_offset;
 		uint32_t index_offset = vertices.size();
 		std::string object_name = mesh_ai->mName.C_Str();
+		if (name != "") object_name = name + "/" + object_name;
 		objects.push_back({object_name, (unsigned)triangles.size(), (unsigned)(triangles.size()+mesh_ai->mNumFaces), material_id});
-		if (materials[material_id].emissive != vec3(0))
-			light_geom.push_back(objects.back());
 		
 		for (uint32_t i = 0; i < mesh_ai->mNumVertices; ++i) {
 			vertex vertex;
-			vertex.pos = to_glm(mesh_ai->mVertices[i]);
-			vertex.norm = to_glm(mesh_ai->mNormals[i]);
+			vertex.pos = vec3(trafo * vec4(to_glm(mesh_ai->mVertices[i]), 1.0f));
+			vertex.norm = normalize(normal_trafo * to_glm(mesh_ai->mNormals[i]));
 			if (mesh_ai->HasTextureCoords(0))
 				vertex.tc = vec2(to_glm(mesh_ai->mTextureCoords[0][i]));
 			else
@@ -176,11 +176,43 @@ void scene::add(const filesystem::path& path, const std::string &name, const mat
 			else
 				std::cout << "WARN: Mesh: skipping non-triangle [" << face.mNumIndices << "] face (that the ass imp did not triangulate)!" << std::endl;
 		}
+		objects.back().end = triangles.size();
 	}
+	for (uint32_t i = loaded_at.size(); !loaded_at.empty() && i < triangles.size(); ++i)
+		loaded_at.push_back(i);
+}
+
+void scene::reorder_triangles(const std::vector<uint32_t> &from) {
+	assert(from.size() == triangles.size());
+	std::vector<::triangle> reordered(from.size());
+	std::vector<uint32_t> origin(from.size());
+	for (uint32_t i = 0; i < from.size(); ++i) {
+		reordered[i] = triangles[from[i]];
+		origin[i] = loaded_at.empty() ? from[i] : loaded_at[from[i]];
+	}
+	triangles = std::move(reordered);
+	loaded_at = std::move(origin);
+}
+
+void scene::restore_triangle_order() {
+	if (loaded_at.empty())
+		return;
+	std::vector<::triangle> restored(triangles.size());
+	for (uint32_t i = 0; i < triangles.size(); ++i)
+		restored[loaded_at[i]] = triangles[i];
+	triangles = std::move(restored);
+	loaded_at.clear();
 }
 	
+/*! Emissive triangles are found by their material, so this stays valid after a bvh reordered the triangles and can
+ *  be repeated after material edits without touching the acceleration structure.
+ */
 void scene::compute_light_distribution() {
-	unsigned prims = 0; for (auto g : light_geom) prims += g.end-g.start;
+	std::vector<uint32_t> emissive;
+	for (uint32_t i = 0; i < triangles.size(); ++i)
+		if (materials[triangles[i].material_id].emissive != vec3(0))
+			emissive.push_back(i);
+	unsigned prims = emissive.size();
 #ifdef RTGI_WITH_SKY
 	if (prims == 0 && !sky) {
 		std::cerr << "WARNING: There is neither emissive geometry nor a skylight" << std::endl;
@@ -193,8 +225,14 @@ void scene::compute_light_distribution() {
 	}
 #endif
 	if (verbose_scene) cout << "light distribution of " << prims << " triangles" << endl;
-	for (auto l : lights) delete l;
+	for (auto l : lights) {
+#ifdef RTGI_WITH_SKY
+		if (l == sky) continue;
+#endif
+		delete l;
+	}
 	lights.clear();
+	delete light_distribution;
 	int n = prims;
 #ifdef RTGI_WITH_SKY
 	if (sky) {
@@ -206,12 +244,10 @@ void scene::compute_light_distribution() {
 	lights.resize(n);
 	std::vector<float> power(n);
 	int l = 0;
-	for (auto g : light_geom) {
-		for (int i = g.start; i < g.end; ++i) {
-			lights[l] = new trianglelight(*this, i);
-			power[l] = luma(lights[l]->power());
-			l++;
-		}
+	for (uint32_t i : emissive) {
+		lights[l] = new trianglelight(*this, i);
+		power[l] = luma(lights[l]->power());
+		l++;
 	}
 #ifdef RTGI_WITH_SKY
 	if (sky) {
@@ -233,6 +269,16 @@ scene::~scene() {
 		delete brdf;
 }
 
+vertex scene::instanced_vertex(uint32_t v, uint32_t instance) const {
+	if (instance == triangle_intersection::no_instance)
+		return vertices[v];
+	const scene::instance &inst = instances[instance];
+	vertex placed = vertices[v];
+	placed.pos = vec3(inst.trafo * vec4(placed.pos, 1.0f));
+	placed.norm = normalize(inst.normal_trafo * placed.norm);
+	return placed;
+}
+
 vec3 scene::normal(const triangle &tri) const {
 	const vec3 &a = vertices[tri.a].pos;
 	const vec3 &b = vertices[tri.b].pos;
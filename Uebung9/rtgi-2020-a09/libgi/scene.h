@@ -113,16 +113,35 @@ struct scene {
 		unsigned start, end;
 		unsigned material_id;
 	};
+	/*! Places an object a further time, without copying its geometry.
+	 *  Only ray tracers that support instancing (the two-level bvh) see instances, and instances of emissive objects
+	 *  are not part of the light distribution.
+	 */
+	struct instance {
+		std::string name;
+		unsigned object;
+		glm::mat4 trafo;
+		glm::mat3 normal_trafo;
+		void place(const glm::mat4 &m) {
+			trafo = m;
+			normal_trafo = glm::transpose(glm::inverse(glm::mat3(m)));
+		}
+	};
 	std::vector<::vertex>    vertices;
 	std::vector<::triangle>  triangles;
 	std::vector<::material>  materials;
 	std::vector<::texture*>  textures;
 	std::vector<object>      objects;
+	std::vector<instance>    instances;
+	/*! Empty while the triangles are in the order they were loaded in (i.e. as described by \ref objects). Ray
+	 *  tracers that reorder the triangles (the flat bbvh layout) do so via \ref reorder_triangles, which records
+	 *  the load position of each triangle here, so that \ref restore_triangle_order can undo it.
+	 */
+	std::vector<uint32_t>    loaded_at;
 	std::map<std::string, brdf*> brdfs;
 	std::vector<light*>      lights;
-	std::vector<object>      light_geom;	// Expires after bvh is built, do not use!
 	void compute_light_distribution();
-	distribution_1d *light_distribution;
+	distribution_1d *light_distribution = nullptr;
 #ifdef RTGI_WITH_SKY
 	skylight *sky = nullptr;
 #endif
@@ -136,7 +155,12 @@ struct scene {
 	scene() : camera(vec3(0,0,-1), vec3(0,0,0), vec3(0,1,0), 65, 1280, 720) {
 	}
 	~scene();
-	void add(const std::filesystem::path &path, const std::string &name, const glm::mat4 &trafo = glm::mat4());
+	void add(const std::filesystem::path &path, const std::string &name, const glm::mat4 &trafo = glm::mat4(1.0f));
+	//! Vertex \c v as placed by the given instance (in world space), no_instance yields the vertex itself
+	vertex instanced_vertex(uint32_t v, uint32_t instance) const;
+	//! Triangle i becomes the triangle that was at position from[i]
+	void reorder_triangles(const std::vector<uint32_t> &from);
+	void restore_triangle_order();
 
 	vec3 normal(const triangle &tri) const;
 	
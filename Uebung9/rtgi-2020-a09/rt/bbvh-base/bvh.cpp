@@ -15,7 +15,10 @@ void naive_bvh::build(::scene *scene) {
 	std::cout << "Building BVH..." << std::endl;
 	auto t1 = std::chrono::high_resolution_clock::now();
 
+	nodes.clear();
 	root = subdivide(scene->triangles, scene->vertices, 0, scene->triangles.size());
+	levels = tree_levels(root, [&](uint32_t i) { return nodes[i].inner(); },
+	                     [&](uint32_t i) { return nodes[i].left; }, [&](uint32_t i) { return nodes[i].right; });
 	
 	auto t2 = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
@@ -77,9 +80,54 @@ uint32_t naive_bvh::subdivide(std::vector<triangle> &triangles, std::vector<vert
 	return id;
 }
 
+/* Refit: Die Topologie bleibt, nur die Boxen werden von den Blättern her neu berechnet.
+ *
+ * Die Knoten liegen in Pre-Order, der Teilbaum von id belegt also genau [id,end) und die beiden Teilbäume sind
+ * unabhängig, große Teilbäume werden daher als Task abgespalten.
+ * Jedes Blatt hält ein Dreieck, n Dreiecke ergeben 2n-1 Knoten. Passt das nicht mehr zur Szene, wird neu gebaut.
+ */
+void naive_bvh::refit() {
+	if (nodes.size() != 2*scene->triangles.size()-1) {
+		std::cout << "The number of triangles changed, rebuilding instead of refitting" << std::endl;
+		build(scene);
+		return;
+	}
+	std::cout << "Refitting BVH..." << std::endl;
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	#pragma omp parallel
+	#pragma omp single
+	refit(root, nodes.size());
+
+	auto t2 = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+	std::cout << "Done after " << duration << "ms" << std::endl;
+}
+
+aabb naive_bvh::refit(uint32_t id, uint32_t end) {
+	aabb box;
+	if (!nodes[id].inner()) {
+		const triangle &tri = scene->triangles[nodes[id].triangle];
+		box.grow(scene->vertices[tri.a].pos);
+		box.grow(scene->vertices[tri.b].pos);
+		box.grow(scene->vertices[tri.c].pos);
+		return box;
+	}
+	aabb box_l, box_r;
+	uint32_t l = nodes[id].left, r = nodes[id].right;
+	#pragma omp task shared(box_l) if(end-id > 8192)
+	box_l = refit(l, r);
+	box_r = refit(r, end);
+	#pragma omp taskwait
+	box.grow(box_l);
+	box.grow(box_r);
+	nodes[id].box = box;
+	return box;
+}
+
 triangle_intersection naive_bvh::closest_hit(const ray &ray) {
 	triangle_intersection closest, intersection;
-	uint32_t stack[25];
+	traversal_stack<uint32_t> stack(levels);
 	int32_t sp = 0;
 	stack[0] = root;
 #ifdef COUNT_HITS
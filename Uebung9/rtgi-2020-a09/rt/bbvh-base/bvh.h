@@ -2,13 +2,69 @@
 
 #include "libgi/scene.h"
 #include "libgi/intersect.h"
+#include "kernels.h"
 
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
 #include <float.h>
 #include <glm/glm.hpp>
 
 // #define COUNT_HITS
 
+//! Traversal stack sized to the depth of the tree, lives on the program stack unless the tree is unusually deep
+template<typename T, int N = 64> struct traversal_stack {
+	T fixed[N];
+	std::unique_ptr<T[]> heap;
+	T *data = fixed;
+	traversal_stack(uint32_t size) {
+		if (size > N) {
+			heap.reset(new T[size]);
+			data = heap.get();
+		}
+	}
+	T& operator[](int i) { return data[i]; }
+};
+
+/* Mailbox (Amanatides, Woo 1987), kept per ray: the ids of the triangles tested last in a small hashed table, so that a
+ * triangle referenced from several leaves (esc, sbvh) is only tested once by a ray. A collision overwrites the older
+ * id, which costs a repeated test but never changes the result.
+ */
+struct mailbox {
+	static constexpr int bits = 3, size = 1 << bits;
+	uint32_t ids[size];
+	uint32_t skipped = 0;
+	mailbox() { std::fill(ids, ids+size, uint32_t(-1)); }
+	//! Was \c id tested before? If not, it counts as tested from now on
+	bool seen(uint32_t id) {
+		uint32_t &slot = ids[(id * 2654435761u) >> (32-bits)];
+		if (slot == id) {
+			skipped++;
+			return true;
+		}
+		slot = id;
+		return false;
+	}
+};
+
+//! Number of levels of the subtree below \c id, the tree is given by inner(id), left(id) and right(id)
+template<typename Inner, typename Left, typename Right>
+uint32_t tree_levels(uint32_t root, const Inner &inner, const Left &left, const Right &right) {
+	uint32_t levels = 0;
+	std::vector<std::pair<uint32_t, uint32_t>> todo { { root, 1 } };
+	while (!todo.empty()) {
+		uint32_t id = todo.back().first, level = todo.back().second;
+		todo.pop_back();
+		levels = std::max(levels, level);
+		if (inner(id)) {
+			todo.push_back({ left(id),  level+1 });
+			todo.push_back({ right(id), level+1 });
+		}
+	}
+	return levels;
+}
+
 struct naive_bvh : public ray_tracer {
 	struct node {
 		aabb box;
@@ -19,16 +75,20 @@ struct naive_bvh : public ray_tracer {
 
 	std::vector<node> nodes;
 	uint32_t root;
+	uint32_t levels = 0;
 	void build(::scene *scene);
+	void refit() override;
 private:
 	uint32_t subdivide(std::vector<triangle> &triangles, std::vector<vertex> &vertices, uint32_t start, uint32_t end);
+	aabb refit(uint32_t id, uint32_t end);
 	triangle_intersection closest_hit(const ray &ray) override;
 	bool any_hit(const ray &ray) override;
 };
 
 enum class bbvh_triangle_layout { flat, indexed };
 enum class bbvh_esc_mode { off, on };
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+enum class bbvh_node_format { full, quantized16, quantized8 };
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format = bbvh_node_format::full>
 struct binary_bvh_tracer : public ray_tracer {
 	/* Innere und Blattknoten werden durch trickserei unterschieden.
 	 * Für Blattknoten gilt:
@@ -45,6 +105,19 @@ struct binary_bvh_tracer : public ray_tracer {
 		void tri_count(int32_t count) { link_r = -count; }
 	};
 
+	/* Quantisierte Knoten: Die Boxen der Kinder werden relativ zur Box des Knotens selbst gespeichert, mit 8 oder 16 Bit
+	 * pro Koordinate. Die Box des Knotens ist beim Traversieren aus dem Elternknoten bekannt (die der Wurzel steht in
+	 * qroot_box), daher braucht es keinen eigenen Bezugsrahmen. Gerundet wird immer nach außen.
+	 */
+	typedef typename std::conditional<node_format == bbvh_node_format::quantized8, uint8_t, uint16_t>::type quant_t;
+	struct qnode {
+		quant_t lo_l[3], hi_l[3], lo_r[3], hi_r[3];
+		int32_t link_l, link_r;
+		bool inner() const { return link_r >= 0; }
+		int32_t tri_offset() const { return -link_l; }
+		int32_t tri_count()  const { return -link_r; }
+	};
+
 	struct prim : public aabb {
 		prim() : aabb() {}
 		prim(const aabb &box, uint32_t tri_index) : aabb(box), tri_index(tri_index) {}
@@ -57,28 +130,234 @@ struct binary_bvh_tracer : public ray_tracer {
 
 	std::vector<node> nodes;
 	std::vector<uint32_t> index;  // can be empty if we don't use indexing
+	std::vector<qnode> qnodes;    // traversal copy of nodes, only used with quantized node formats
+	std::vector<triangle_record> records;  // intersection-ready triangles in leaf order (empty if off)
+	std::vector<triangle_block<4>> blocks4;  // SIMD triangle blocks, each leaf fills consecutive blocks (empty if off)
+	std::vector<triangle_block<8>> blocks8;
+	std::vector<uint32_t> leaf_block;      // first block of the leaf starting at each leaf position
+	aabb qroot_box;
 	
-	enum binary_split_type {sm, om, sah};
+	enum binary_split_type {sm, om, sah, binned_sah, lbvh, sah_full, sbvh};
 	binary_split_type binary_split_type = om;
 	
 	int max_triangles_per_node = 1;
 
 	int number_of_planes;
+	int number_of_bins = 16;
+	int morton_bits = 30;             // 30 (3x10 bit) or 63 (3x21 bit) for lbvh
+	uint32_t exact_sweep_below = 1024;  // sah_full: nodes smaller than this are swept exactly, larger ones binned
+	float cost_traversal = 1;         // K_T
+	float cost_intersect = 1;         // K_I
+	float sbvh_alpha = 1e-5f;         // sbvh: spatial splits are only tried if the children overlap more than this (relative to the root)
+	bool parallel_build = false;
+	uint32_t parallel_cutoff = 4096;  // smaller ranges are built by a single task
 	uint32_t root;
 	bool should_export = false;
 	uint32_t max_depth;
+	uint32_t levels = 0;              // depth of the tree, the traversal stack is sized accordingly
+	enum traversal_mode {with_stack, restart_trail};
+	traversal_mode traversal_mode = with_stack;  // restart_trail needs no stack, but supports at most 64 levels
+	float build_time_ms = 0;
+	float sah_cost_after_build = 0;
+	float sah_cost_before_optimization = 0;
+	int optimization_passes = 0;      // treelet restructuring after the build (0: off)
+	enum node_layout {dfs, bfs_treelets, veb};
+	node_layout node_layout = dfs;
+	int treelet_size = 8;             // nodes per treelet for bfs_treelets
+	bool colocate_triangles = false;  // order the triangles like the leaves in the node array
+	std::string cache_dir;            // store/load built BVHs here (empty: off)
+	float refit_rebuild_factor = 0;   // refit rebuilds if the SAH cost grew beyond this factor (0: never)
+	bool use_triangle_records = false;  // leaves read records instead of triangles and vertices
+	int triangle_block_width = 0;     // leaves are intersected in SIMD blocks of 4 or 8 triangles (0: off)
+	bool packet_traversal = true;     // closest_hit_packet traverses with the whole packet (off: ray by ray)
+	enum occlusion_order {by_distance, by_axis, unordered};
+	occlusion_order occlusion_order = by_axis;      // child order of any_hit, see any_hit_stack
+	bool use_occluder_cache = true;   // any_hit first tests the triangle that blocked the thread's previous shadow ray
+	enum box_kernel {box_branchy, box_divide, box_reciprocal, box_precomputed, box_simd};
+	enum tri_kernel {tri_shirley, tri_moeller, tri_baldwin, tri_woop};
+	box_kernel box_kernel = box_precomputed;  // intersection kernels of the stack traversal, see bvh kernel
+	tri_kernel tri_kernel = tri_shirley;
+	std::vector<baldwin_weber_record> bw_records;  // per leaf position, only while tri_baldwin is selected
+	bool use_mailbox = true;          // test triangles referenced from several leaves once per ray (indexed layout only)
+	struct alignas(64) thread_slot {  // one per thread, a cache line each
+		int32_t occluder = -1;        // leaf position of the last blocker
+		uint64_t occluder_tests = 0, occluder_hits = 0;
+		uint64_t mailbox_skipped = 0;
+	};
+	std::vector<thread_slot> thread_slots;
+	bool verbose = true;              // progress output of build and refit (off for the bottom levels of a two-level bvh)
+	uint32_t first_triangle = 0;      // indexed layout: build over triangle_count scene triangles starting here,
+	uint32_t triangle_count = 0;      // hits still refer to scene->triangles (0: all triangles)
+	uint32_t triangles_built = 0;     // triangles_in_bvh() at the last build, refit rebuilds if that changed
 	
 	binary_bvh_tracer();
 	void build(::scene *scene) override;
+	void refit() override;
+	float sah_cost() const;
 	triangle_intersection closest_hit(const ray &ray) override;
 	bool any_hit(const ray &ray) override;
+	//! Same as closest_hit/any_hit without the stats timer, which would dominate for small trees traced from another tracer
+	triangle_intersection closest_hit_untimed(const ray &ray);
+	bool any_hit_untimed(const ray &ray);
+	void closest_hit_packet(const ray_packet &packet, triangle_intersection *closest) override;
+	//! Test the triangle at leaf position \c i (tri_offset()+k), from the records if there are any
+	bool intersect_leaf_triangle(int i, const ray &ray, triangle_intersection &is) {
+		if (!records.empty())
+			return intersect(records[i], ray, is);
+		return intersect(scene->triangles[triangle_index(i)], scene->vertices.data(), ray, is);
+	}
+	//! Vertex positions of the triangle at leaf position \c i
+	void leaf_triangle(int i, vec3 &a, vec3 &b, vec3 &c) {
+		const triangle &tri = scene->triangles[triangle_index(i)];
+		a = scene->vertices[tri.a].pos;
+		b = scene->vertices[tri.b].pos;
+		c = scene->vertices[tri.c].pos;
+	}
+	//! Update \c closest with the nearest of the \c count triangles at leaf positions \c offset... if it is closer.
+	//! Triangles already in the mailbox (if given) are skipped, the SIMD blocks are always tested as a whole.
+	template<typename tri_test = shirley_tri_test>
+	void intersect_leaf(int32_t offset, int32_t count, const ray &ray, triangle_intersection &closest, mailbox *mb = nullptr) {
+		if (!blocks4.empty())
+			return intersect_leaf_blocks(blocks4, offset, count, ray, closest);
+		if (!blocks8.empty())
+			return intersect_leaf_blocks(blocks8, offset, count, ray, closest);
+		triangle_intersection intersection;
+		for (int i = 0; i < count; ++i)
+			if (mb && mb->seen(triangle_index(offset+i)))
+				continue;
+			else if (tri_test::test(*this, offset+i, ray, intersection))
+				if (intersection.t < closest.t) {
+					closest = intersection;
+					closest.ref = triangle_index(offset+i);
+				}
+	}
+	//! Is any of the \c count triangles at leaf positions \c offset... hit? Stores the position of the blocker.
+	template<typename tri_test = shirley_tri_test>
+	bool any_hit_leaf(int32_t offset, int32_t count, const ray &ray, int32_t *blocker = nullptr, mailbox *mb = nullptr) {
+		alignas(32) float t[8], beta[8], gamma[8];
+		if (!blocks4.empty()) {
+			for (int k = 0; k < count; k += 4)
+				if (int hit = intersect(blocks4[leaf_block[offset]+k/4], ray, ray.t_max, t, beta, gamma)) {
+					if (blocker) *blocker = offset + k + __builtin_ctz(hit);
+					return true;
+				}
+			return false;
+		}
+		if (!blocks8.empty()) {
+			for (int k = 0; k < count; k += 8)
+				if (int hit = intersect(blocks8[leaf_block[offset]+k/8], ray, ray.t_max, t, beta, gamma)) {
+					if (blocker) *blocker = offset + k + __builtin_ctz(hit);
+					return true;
+				}
+			return false;
+		}
+		triangle_intersection intersection;
+		for (int i = 0; i < count; ++i)
+			if (mb && mb->seen(triangle_index(offset+i)))
+				continue;
+			else if (tri_test::test(*this, offset+i, ray, intersection)) {
+				if (blocker) *blocker = offset + i;
+				return true;
+			}
+		return false;
+	}
 	bool interprete(const std::string &command, std::istringstream &in) override;
 
 private:
 	void early_split_clipping(std::vector<prim> &prims, std::vector<uint32_t> &index);
-	uint32_t subdivide_om(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end);
-	uint32_t subdivide_sm(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end);
-	uint32_t subdivide_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end);
+	uint32_t subdivide_om(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id);
+	uint32_t subdivide_sm(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id);
+	uint32_t subdivide_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id);
+	uint32_t subdivide_binned_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id);
+	uint32_t subdivide_sah_full(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id);
+
+	// SBVH (Stich 2009): references are (partial) triangle boxes that may be duplicated by spatial splits,
+	// hence the primitive count is not known in advance and nodes are appended as we go (no parallel build).
+	uint32_t build_sbvh(std::vector<prim> &prims, std::vector<uint32_t> &index);
+	uint32_t subdivide_sbvh(std::vector<prim> &refs, std::vector<prim> &out, float root_area);
+	void split_reference(const prim &ref, int axis, float pos, aabb &left, aabb &right);
+
+	// LBVH (Karras 2012): inner node i covers the sorted primitives [first,last] and is split after split.
+	// Its children are split and split+1, each either a leaf (if the range is a single primitive) or an inner node.
+	struct lbvh_node {
+		uint32_t first, last, split;
+	};
+	template<typename code_t>
+	std::vector<lbvh_node> lbvh_hierarchy(std::vector<prim> &prims, std::vector<uint32_t> &index, int bits_per_axis);
+	aabb emit_lbvh(std::vector<prim> &prims, std::vector<uint32_t> &index, const std::vector<lbvh_node> &hierarchy,
+	               uint32_t first, uint32_t last, uint32_t id);
+
+	// Building blocks shared by the subdivide_* variants, these run in parallel if parallel_build is set
+	static node unused_node() { node n; n.link_l = n.link_r = 0; return n; }
+	uint32_t make_leaf(uint32_t id, uint32_t start, uint32_t end);
+	template<typename F> uint32_t make_inner(uint32_t id, uint32_t start, uint32_t mid, uint32_t end, const F &subdivide);
+	template<typename L, typename R> void fork(uint32_t n, const L &left, const R &right);
+	int chunk_count(uint32_t start, uint32_t end) const;
+	template<typename F> void for_each_chunk(uint32_t start, uint32_t end, const F &fn);
+	template<typename F> aabb bounds(uint32_t start, uint32_t end, const F &element);
+	template<typename F> uint32_t partition(std::vector<uint32_t> &index, uint32_t start, uint32_t end, const F &left_side);
+	void compact_nodes();
+	aabb refit(uint32_t id, int depth);
+
+	// Treelet restructuring (Karras, Aila 2013), per node box, SAH cost and triangle count are kept alongside the tree
+	void optimize_treelets();
+	void optimize_subtree(uint32_t id, int depth, std::vector<aabb> &box, std::vector<float> &cost, std::vector<uint32_t> &count);
+	void restructure_treelet(uint32_t id, std::vector<aabb> &box, std::vector<float> &cost, std::vector<uint32_t> &count);
+
+	// Node order in memory, see relayout_nodes
+	void relayout_nodes(enum node_layout layout);
+	void colocate_leaf_triangles(std::vector<uint32_t> &index);
+	void layout_benchmark(int rays);
+
+	// On-disk cache, keyed by a hash over geometry and builder settings
+	uint64_t cache_key() const;
+	std::string cache_file(uint64_t key) const;
+	bool load_cache(uint64_t key);
+	void store_cache(uint64_t key, const std::vector<uint32_t> &order);
+	uint32_t triangles_in_bvh() const { return triangle_count ? triangle_count : scene->triangles.size(); }
+
+	void quantize_nodes();
+	void build_triangle_records();
+	void build_baldwin_weber_records();
+	template<int W> void build_triangle_blocks(std::vector<triangle_block<W>> &blocks);
+	template<int W> void intersect_leaf_blocks(const std::vector<triangle_block<W>> &blocks, int32_t offset, int32_t count,
+	                                           const ray &ray, triangle_intersection &closest) {
+		alignas(32) float t[W], beta[W], gamma[W];
+		const triangle_block<W> *b = &blocks[leaf_block[offset]];
+		for (int k = 0; k < count; k += W, ++b)
+			for (int hit = intersect(*b, ray, std::min(closest.t, ray.t_max), t, beta, gamma); hit; hit &= hit-1) {
+				int j = __builtin_ctz(hit);
+				if (t[j] < closest.t) {
+					closest.t = t[j];
+					closest.beta = beta[j];
+					closest.gamma = gamma[j];
+					closest.ref = triangle_index(offset+k+j);
+				}
+			}
+	}
+	//! Leaf cost in units of K_I: triangles, or blocks if leaves are intersected in SIMD blocks
+	uint32_t intersect_units(uint32_t n) const {
+		return triangle_block_width ? (n + triangle_block_width-1) / triangle_block_width : n;
+	}
+	static aabb dequantize(const aabb &frame, const quant_t *lo, const quant_t *hi);
+	triangle_intersection closest_hit_quantized(const ray &ray, mailbox *mb);
+	bool any_hit_quantized(const ray &ray, int32_t &blocker, mailbox *mb);
+	triangle_intersection closest_hit_restart_trail(const ray &ray, mailbox *mb);
+	bool any_hit_restart_trail(const ray &ray, int32_t &blocker, mailbox *mb);
+	template<typename box_test, typename tri_test> triangle_intersection closest_hit_stack(const ray &ray, mailbox *mb);
+	template<typename box_test, typename tri_test> bool any_hit_stack(const ray &ray, int32_t &blocker, mailbox *mb);
+	// The instantiations of the above for box_kernel and tri_kernel
+	triangle_intersection (binary_bvh_tracer::*closest_hit_kernel)(const ray &ray, mailbox *mb);
+	bool (binary_bvh_tracer::*any_hit_kernel)(const ray &ray, int32_t &blocker, mailbox *mb);
+	void select_kernel();
+	template<typename box_test> void select_tri_kernel();
+	void kernel_benchmark(int rays);
+	//! Only worth it if leaves share triangles, and only the scalar leaf tests can skip single triangles
+	bool mailboxing() const { return use_mailbox && duplicate_references && !triangle_block_width; }
+	bool duplicate_references = false;  // the index holds some triangles more than once
+	thread_slot* this_thread_slot();  // null for threads beyond the slots allocated at build time
+	size_t traversal_bytes() const;
+
 	void print_node_stats();
 	void export_bvh(uint32_t node, uint32_t *id, uint32_t depth, std::string *filename);
 
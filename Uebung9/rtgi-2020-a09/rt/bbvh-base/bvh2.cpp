@@ -6,12 +6,23 @@
 #include <iostream>
 #include <fstream>
 #include <chrono>
+#include <cmath>
+#include <limits>
+#include <functional>
+#include <cstring>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <random>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
-#define K_T 1
-#define K_I 1
 #define error(x) { std::cerr << "command " << " (" << command << "): " << x << std::endl; return true;}
 #define check_in_complete(x) { if (in.bad() || in.fail() || !in.eof()) error(x); }
 using namespace glm;
@@ -20,46 +31,871 @@ using namespace glm;
 //    a more realistic binary bvh
 //
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-binary_bvh_tracer<tr_layout, esc_mode>::binary_bvh_tracer() {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+binary_bvh_tracer<tr_layout, esc_mode, node_format>::binary_bvh_tracer() {
+	select_kernel();
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-void binary_bvh_tracer<tr_layout, esc_mode>::build(::scene *scene) {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::build(::scene *scene) {
 	time_this_block(build_bvh);
 	this->scene = scene;
-	std::cout << "Building BVH..." << std::endl;
+	triangles_built = triangles_in_bvh();
+	if (verbose) std::cout << "Building BVH..." << std::endl;
 	auto t1 = std::chrono::high_resolution_clock::now();
 
+	uint64_t key = 0;
+	if (!cache_dir.empty()) {
+		key = cache_key();
+		if (load_cache(key)) {
+			quantize_nodes();
+			build_triangle_records();
+			levels = tree_levels(root, [&](uint32_t i) { return nodes[i].inner(); },
+			                     [&](uint32_t i) { return nodes[i].link_l; }, [&](uint32_t i) { return nodes[i].link_r; });
+			auto t2 = std::chrono::high_resolution_clock::now();
+			build_time_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+			if (verbose) std::cout << "Loaded from " << cache_file(key) << " after " << build_time_ms << "ms" << std::endl;
+			return;
+		}
+	}
+
 	// convert triangles to boxes
-	std::vector<prim> prims(scene->triangles.size());
+	assert(tr_layout != bbvh_triangle_layout::flat || (first_triangle == 0 && triangle_count == 0));
+	std::vector<prim> prims(triangles_in_bvh());
 	std::vector<uint32_t> index(prims.size());
 	for (int i = 0; i < prims.size(); ++i) {
-		prims[i].grow(scene->vertices[scene->triangles[i].a].pos);
-		prims[i].grow(scene->vertices[scene->triangles[i].b].pos);
-		prims[i].grow(scene->vertices[scene->triangles[i].c].pos);
-		prims[i].tri_index = i; // with esc, this is different form the box index
+		const triangle &tri = scene->triangles[first_triangle + i];
+		prims[i].grow(scene->vertices[tri.a].pos);
+		prims[i].grow(scene->vertices[tri.b].pos);
+		prims[i].grow(scene->vertices[tri.c].pos);
+		prims[i].tri_index = first_triangle + i; // with esc, this is different form the box index
 		index[i] = i;
 	}
 
-	if (esc_mode == bbvh_esc_mode::on)
+	if (esc_mode == bbvh_esc_mode::on && binary_split_type != sbvh)
 		early_split_clipping(prims, index);
 
-	if (binary_split_type == om) {
-		root = subdivide_om(prims, index, 0, prims.size());
+	// Ein Teilbaum über n Primitive hat höchstens 2n-1 Knoten, jeder Teilbaum bekommt genau diesen Bereich
+	// reserviert und kann so unabhängig von den anderen (auch parallel) geschrieben werden.
+	nodes.assign(2*prims.size()-1, unused_node());
+	std::vector<lbvh_node> hierarchy;
+	if (binary_split_type == lbvh) {
+		if (morton_bits == 30) hierarchy = lbvh_hierarchy<uint32_t>(prims, index, 10);
+		else                   hierarchy = lbvh_hierarchy<uint64_t>(prims, index, 21);
 	}
-	else if (binary_split_type == sm) {
-		root = subdivide_sm(prims, index, 0, prims.size());
+	auto subdivide = [&]() {
+		if (binary_split_type == om) {
+			root = subdivide_om(prims, index, 0, prims.size(), 0);
+		}
+		else if (binary_split_type == sm) {
+			root = subdivide_sm(prims, index, 0, prims.size(), 0);
+		}
+		else if(binary_split_type == sah) {
+			root = subdivide_sah(prims, index, 0, prims.size(), 0);
+		}
+		else if (binary_split_type == binned_sah) {
+			root = subdivide_binned_sah(prims, index, 0, prims.size(), 0);
+		}
+		else if (binary_split_type == sah_full) {
+			root = subdivide_sah_full(prims, index, 0, prims.size(), 0);
+		}
+		else if (binary_split_type == sbvh) {
+			root = build_sbvh(prims, index);
+		}
+		else if (binary_split_type == lbvh) {
+			root = 0;
+			emit_lbvh(prims, index, hierarchy, 0, prims.size()-1, root);
+		}
+	};
+	if (parallel_build) {
+		#pragma omp parallel
+		#pragma omp single
+		subdivide();
 	}
-	else if(binary_split_type == sah) {
-		root = subdivide_sah(prims, index, 0, prims.size());
+	else
+		subdivide();
+	compact_nodes();
+	if (optimization_passes > 0) {
+		sah_cost_before_optimization = sah_cost();
+		optimize_treelets();
 	}
+	if (optimization_passes > 0 || node_layout != dfs)
+		relayout_nodes(node_layout);
+	if (colocate_triangles)
+		colocate_leaf_triangles(index);
 
 	commit_shuffled_triangles(prims, index);
+	sah_cost_after_build = sah_cost();
+	quantize_nodes();
+	build_triangle_records();
+	levels = tree_levels(root, [&](uint32_t i) { return nodes[i].inner(); },
+	                     [&](uint32_t i) { return nodes[i].link_l; }, [&](uint32_t i) { return nodes[i].link_r; });
+	if (!cache_dir.empty())
+		store_cache(key, index);
+
+	auto t2 = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+	build_time_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+	if (verbose) std::cout << "Done after " << duration << "ms" << std::endl;
+}
+
+/* Refit: Die Topologie bleibt, nur die Boxen werden von den Blättern her neu berechnet. Ist der Baum dadurch (laut
+ * SAH) um mehr als refit_rebuild_factor schlechter geworden als direkt nach dem Aufbau, wird doch neu gebaut.
+ * Wurden Dreiecke (esc, sbvh) auf mehrere Blätter verteilt, so müsste jedes davon wieder das ganze Dreieck umschließen,
+ * der Baum würde unbrauchbar. In dem Fall wird gleich neu gebaut, ebenso wenn seit dem Aufbau Dreiecke dazugekommen
+ * sind (load), denn die kommen im alten Baum nicht vor.
+ * Die beiden Teilbäume eines Knotens sind unabhängig voneinander, die oberen Ebenen laufen daher als Tasks.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::refit() {
+	if (triangles_built != triangles_in_bvh()) {
+		if (verbose) std::cout << "The number of triangles changed, rebuilding instead of refitting" << std::endl;
+		build(scene);
+		return;
+	}
+	if (tr_layout != bbvh_triangle_layout::flat && index.size() != triangles_in_bvh()) {
+		if (verbose) std::cout << "BVH references split triangles, rebuilding instead of refitting" << std::endl;
+		build(scene);
+		return;
+	}
+	time_this_block(refit_bvh);
+	if (verbose) std::cout << "Refitting BVH..." << std::endl;
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	#pragma omp parallel
+	#pragma omp single
+	refit(root, 0);
+	quantize_nodes();
+	build_triangle_records();
 
 	auto t2 = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
-	std::cout << "Done after " << duration << "ms" << std::endl;
+	if (verbose) std::cout << "Done after " << duration << "ms" << std::endl;
+
+	if (refit_rebuild_factor > 0) {
+		float cost = sah_cost();
+		if (cost > refit_rebuild_factor * sah_cost_after_build) {
+			if (verbose) std::cout << "SAH cost went from " << sah_cost_after_build << " to " << cost << ", rebuilding" << std::endl;
+			build(scene);
+		}
+	}
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+aabb binary_bvh_tracer<tr_layout, esc_mode, node_format>::refit(uint32_t id, int depth) {
+	const node &n = nodes[id];
+	aabb box;
+	if (!n.inner()) {
+		for (int i = n.tri_offset(); i < n.tri_offset()+n.tri_count(); ++i) {
+			const triangle &tri = scene->triangles[triangle_index(i)];
+			box.grow(scene->vertices[tri.a].pos);
+			box.grow(scene->vertices[tri.b].pos);
+			box.grow(scene->vertices[tri.c].pos);
+		}
+		return box;
+	}
+	uint32_t l = n.link_l, r = n.link_r;
+	#pragma omp task if(depth < 10)
+	nodes[id].box_l = refit(l, depth+1);
+	nodes[id].box_r = refit(r, depth+1);
+	#pragma omp taskwait
+	box.grow(nodes[id].box_l);
+	box.grow(nodes[id].box_r);
+	return box;
+}
+
+/* SAH-Kosten des Baums relativ zur Oberfläche der Wurzel: K_T für jeden inneren Knoten, K_I für jedes Dreieck eines
+ * Blatts, jeweils gewichtet mit der Wahrscheinlichkeit, dass der Knoten von einem Strahl getroffen wird.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+float binary_bvh_tracer<tr_layout, esc_mode, node_format>::sah_cost() const {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	if (!nodes[root].inner())
+		return cost_intersect * intersect_units(nodes[root].tri_count());
+	aabb root_box = nodes[root].box_l;
+	root_box.grow(nodes[root].box_r);
+	double cost = 0;
+	#pragma omp parallel for reduction(+:cost)
+	for (int i = 0; i < nodes.size(); ++i) {
+		const node &n = nodes[i];
+		if (!n.inner())
+			continue;
+		auto child = [&](int32_t link, const aabb &box) {
+			const node &c = nodes[link];
+			return box_surface(box) * (c.inner() ? cost_traversal : cost_intersect * intersect_units(c.tri_count()));
+		};
+		cost += child(n.link_l, n.box_l) + child(n.link_r, n.box_r);
+	}
+	return cost_traversal + cost / std::max(box_surface(root_box), FLT_MIN);
+}
+
+/* Treelet Restructuring (Karras, Aila, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies", 2013)
+ *
+ * Von unten nach oben wird für jeden inneren Knoten ein Treelet aus bis zu 7 Teilbäumen gebildet (immer der mit der
+ * größten Oberfläche wird durch seine Kinder ersetzt) und per dynamischer Programmierung über alle Teilmengen die
+ * Anordnung mit minimalen SAH-Kosten bestimmt. Die inneren Knoten des Treelets werden dafür wiederverwendet, die
+ * Blätter (und damit die Reihenfolge der Dreiecke) bleiben unverändert. Unabhängige Teilbäume laufen als Tasks.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::optimize_treelets() {
+	if (!nodes[root].inner())
+		return;
+	std::vector<aabb> box(nodes.size());
+	std::vector<float> cost(nodes.size());
+	std::vector<uint32_t> count(nodes.size());
+	box[root] = nodes[root].box_l;
+	box[root].grow(nodes[root].box_r);
+	for (int i = 0; i < nodes.size(); ++i)
+		if (nodes[i].inner()) {
+			box[nodes[i].link_l] = nodes[i].box_l;
+			box[nodes[i].link_r] = nodes[i].box_r;
+		}
+	for (int pass = 0; pass < optimization_passes; ++pass) {
+		#pragma omp parallel
+		#pragma omp single
+		optimize_subtree(root, 0, box, cost, count);
+	}
+	// Die wiederverwendeten Knoten liegen danach nicht mehr in Pre-Order, das erledigt relayout_nodes in build
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::optimize_subtree(uint32_t id, int depth, std::vector<aabb> &box, std::vector<float> &cost,
+                                                              std::vector<uint32_t> &count) {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	if (!nodes[id].inner()) {
+		count[id] = nodes[id].tri_count();
+		cost[id] = cost_intersect * box_surface(box[id]) * intersect_units(count[id]);
+		return;
+	}
+	uint32_t l = nodes[id].link_l, r = nodes[id].link_r;
+	#pragma omp task shared(box, cost, count) if(depth < 10)
+	optimize_subtree(l, depth+1, box, cost, count);
+	optimize_subtree(r, depth+1, box, cost, count);
+	#pragma omp taskwait
+	count[id] = count[l] + count[r];
+	cost[id] = cost_traversal * box_surface(box[id]) + cost[l] + cost[r];
+	restructure_treelet(id, box, cost, count);
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::restructure_treelet(uint32_t id, std::vector<aabb> &box, std::vector<float> &cost,
+                                                                 std::vector<uint32_t> &count) {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	const int max_leaves = 7;
+	uint32_t leaves[max_leaves], internal[max_leaves-1];
+	int n = 2, n_internal = 1;
+	leaves[0] = nodes[id].link_l;
+	leaves[1] = nodes[id].link_r;
+	internal[0] = id;
+	while (n < max_leaves) {
+		int largest = -1;
+		for (int i = 0; i < n; ++i)
+			if (nodes[leaves[i]].inner() && (largest == -1 || box_surface(box[leaves[i]]) > box_surface(box[leaves[largest]])))
+				largest = i;
+		if (largest == -1)
+			break;
+		uint32_t expand = leaves[largest];
+		internal[n_internal++] = expand;
+		leaves[largest] = nodes[expand].link_l;
+		leaves[n++]     = nodes[expand].link_r;
+	}
+	if (n < 3)
+		return;
+
+	// Optimale Kosten für jede Teilmenge der Treelet-Blätter, Teilmengen sind immer kleiner als ihre Obermenge
+	const int all = (1<<n) - 1;
+	aabb subset_box[1<<max_leaves];
+	float subset_cost[1<<max_leaves];
+	int subset_split[1<<max_leaves];
+	for (int s = 1; s <= all; ++s) {
+		int low = s & -s;
+		if (s == low) {
+			int i = __builtin_ctz(s);
+			subset_box[s] = box[leaves[i]];
+			subset_cost[s] = cost[leaves[i]];
+			continue;
+		}
+		subset_box[s] = subset_box[s ^ low];
+		subset_box[s].grow(subset_box[low]);
+		float best = FLT_MAX;
+		// Jede Aufteilung nur einmal: die linke Hälfte enthält immer das niedrigste Element
+		for (int p = (s-1) & s; p; p = (p-1) & s)
+			if ((p & low) && subset_cost[p] + subset_cost[s^p] < best) {
+				best = subset_cost[p] + subset_cost[s^p];
+				subset_split[s] = p;
+			}
+		subset_cost[s] = cost_traversal * box_surface(subset_box[s]) + best;
+	}
+	if (subset_cost[all] >= cost[id] * (1.0f - 1e-5f))
+		return;
+
+	// Neu verknüpfen, die inneren Knoten werden in beliebiger Reihenfolge wiederverwendet
+	int next_internal = 1;
+	std::function<uint32_t(int, uint32_t)> emit = [&](int s, uint32_t target) {
+		if ((s & (s-1)) == 0)
+			return leaves[__builtin_ctz(s)];
+		int p = subset_split[s];
+		uint32_t l = emit(p,   (p     & (p-1))     ? internal[next_internal++] : 0);
+		uint32_t r = emit(s^p, ((s^p) & ((s^p)-1)) ? internal[next_internal++] : 0);
+		nodes[target].link_l = l;
+		nodes[target].link_r = r;
+		nodes[target].box_l = subset_box[p];
+		nodes[target].box_r = subset_box[s^p];
+		box[target] = subset_box[s];
+		cost[target] = subset_cost[s];
+		count[target] = count[l] + count[r];
+		return target;
+	};
+	emit(all, id);
+	assert(next_internal == n_internal);
+}
+
+/* Anordnung der Knoten im Speicher
+ *
+ * - dfs: Pre-Order, das linke Kind liegt direkt hinter dem Elternknoten, das rechte hinter dem linken Teilbaum
+ * - bfs_treelets: Ab jeder Treelet-Wurzel werden treelet_size Knoten in Breitensuche zusammenhängend abgelegt, die
+ *   Knoten darunter bilden die Wurzeln der nächsten Treelets (die wiederum in Tiefensuche folgen)
+ * - veb: van Emde Boas, der Baum wird auf halber Höhe geteilt, erst kommt die obere Hälfte, dann die unteren Teilbäume,
+ *   jeweils rekursiv genauso. Damit ist die Anordnung für jede Cache-Größe günstig.
+ * Die Wurzel landet immer auf 0. Die Reihenfolge der Dreiecke bleibt erhalten (siehe colocate_leaf_triangles).
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::relayout_nodes(enum node_layout layout) {
+	std::vector<uint32_t> order;
+	order.reserve(nodes.size());
+	if (layout == dfs) {
+		std::vector<uint32_t> stack { root };
+		while (!stack.empty()) {
+			uint32_t id = stack.back();
+			stack.pop_back();
+			order.push_back(id);
+			if (nodes[id].inner()) {
+				stack.push_back(nodes[id].link_r);
+				stack.push_back(nodes[id].link_l);
+			}
+		}
+	}
+	else if (layout == bfs_treelets) {
+		std::vector<uint32_t> treelets { root };
+		while (!treelets.empty()) {
+			uint32_t treelet_root = treelets.back();
+			treelets.pop_back();
+			std::vector<uint32_t> queue { treelet_root };
+			size_t head = 0, below = treelets.size();
+			while (head < queue.size()) {
+				uint32_t id = queue[head++];
+				order.push_back(id);
+				if (!nodes[id].inner())
+					continue;
+				for (uint32_t child : { nodes[id].link_l, nodes[id].link_r })
+					if (queue.size() < size_t(treelet_size)) queue.push_back(child);
+					else                                     treelets.push_back(child);
+			}
+			// der linkeste Teilbaum soll als nächster folgen, also oben auf dem Stack liegen
+			std::reverse(treelets.begin() + below, treelets.end());
+		}
+	}
+	else {
+		std::vector<uint32_t> height(nodes.size(), 1);
+		std::function<uint32_t(uint32_t)> measure = [&](uint32_t id) -> uint32_t {
+			if (nodes[id].inner())
+				height[id] = 1 + std::max(measure(nodes[id].link_l), measure(nodes[id].link_r));
+			return height[id];
+		};
+		// Legt die oberen h Ebenen unter id ab, die Wurzeln direkt darunter landen in below
+		std::function<void(uint32_t, uint32_t, std::vector<uint32_t>&)> veb = [&](uint32_t id, uint32_t h, std::vector<uint32_t> &below) {
+			if (h == 1 || !nodes[id].inner()) {
+				order.push_back(id);
+				if (nodes[id].inner()) {
+					below.push_back(nodes[id].link_l);
+					below.push_back(nodes[id].link_r);
+				}
+				return;
+			}
+			uint32_t top = h / 2;
+			std::vector<uint32_t> middle;
+			veb(id, top, middle);
+			for (uint32_t m : middle)
+				veb(m, h - top, below);
+		};
+		std::vector<uint32_t> none;
+		veb(root, measure(root), none);
+	}
+	assert(order.size() == nodes.size());
+
+	std::vector<uint32_t> new_id(nodes.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+		new_id[order[i]] = i;
+	std::vector<node> out(nodes.size());
+	for (uint32_t i = 0; i < order.size(); ++i) {
+		out[i] = nodes[order[i]];
+		if (out[i].inner()) {
+			out[i].link_l = new_id[out[i].link_l];
+			out[i].link_r = new_id[out[i].link_r];
+		}
+	}
+	root = new_id[root];
+	nodes = std::move(out);
+}
+
+namespace {
+	//! Zählt Cache-Zugriffe bzw. -Fehlzugriffe dieses Prozesses (siehe perf_event_open(2)), -1 wenn nicht verfügbar
+	struct cache_counter {
+		int fd = -1;
+		cache_counter(uint64_t cache, uint64_t result) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.size = sizeof(attr);
+			attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+		~cache_counter() { if (fd >= 0) close(fd); }
+		void start() { if (fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); } }
+		void stop()  { if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); }
+		long long value() {
+			long long v = -1;
+			if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v)) return -1;
+			return v;
+		}
+	};
+}
+
+/* Verfolgt für jede Anordnung die gleichen inkohärenten Strahlen (zufälliger Ursprung in der Szene, zufällige
+ * Richtung, wie die Sekundärstrahlen beim Path Tracing) und gibt Zeit sowie L1d- und LLC-Fehlzugriffe aus. Die
+ * Zähler gibt es nur, wenn perf_event_open erlaubt ist (siehe /proc/sys/kernel/perf_event_paranoid).
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::layout_benchmark(int rays) {
+	std::vector<::ray> sample(rays);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	aabb bounds = scene->scene_bounds;
+	for (auto &r : sample) {
+		vec3 o = bounds.min + vec3(uniform(rng), uniform(rng), uniform(rng)) * (bounds.max - bounds.min);
+		vec3 d;
+		do d = vec3(uniform(rng), uniform(rng), uniform(rng)) * 2.0f - 1.0f; while (dot(d, d) > 1 || dot(d, d) < 1e-4f);
+		r = ::ray(o, normalize(d));
+	}
+	const char *name[] = { "dfs", "bfs", "veb" };
+	for (enum node_layout layout : { dfs, bfs_treelets, veb }) {
+		relayout_nodes(layout);
+		quantize_nodes();
+		cache_counter l1_access(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+		cache_counter l1_miss(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS);
+		cache_counter ll_access(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+		cache_counter ll_miss(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS);
+		for (auto *c : { &l1_access, &l1_miss, &ll_access, &ll_miss }) c->start();
+		auto t1 = std::chrono::high_resolution_clock::now();
+		int hits = 0;
+		for (auto &r : sample)
+			if (closest_hit(r).valid())
+				hits++;
+		auto t2 = std::chrono::high_resolution_clock::now();
+		for (auto *c : { &l1_access, &l1_miss, &ll_access, &ll_miss }) c->stop();
+		float ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+		auto rate = [&](cache_counter &miss, cache_counter &access) {
+			long long m = miss.value(), a = access.value();
+			if (m < 0 || a <= 0) return std::string("n/a");
+			return std::to_string(float(m)/rays) + "/ray (" + std::to_string(100.0f*m/a) + "%)";
+		};
+		std::cout << name[layout] << ": " << ms << "ms, " << rays/ms/1000 << " Mrays/s, " << hits << " hits, "
+		          << "L1d misses " << rate(l1_miss, l1_access) << ", LLC misses " << rate(ll_miss, ll_access) << std::endl;
+	}
+	relayout_nodes(node_layout);
+	quantize_nodes();
+}
+
+static const char *box_kernel_names[] = { "branchy", "divide", "reciprocal", "precomputed", "simd" };
+static const char *tri_kernel_names[] = { "shirley", "moeller", "baldwin", "woop" };
+
+/* Die Kernel werden beim Übersetzen in die Stack-Traversierung eingesetzt, hier wird nur ausgewählt, welche
+ * Instanz closest_hit/any_hit aufrufen. Für quantisierte Knoten gibt es (nur) die Voreinstellung.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::select_kernel() {
+	if constexpr (node_format == bbvh_node_format::full)
+		switch (box_kernel) {
+			case box_branchy:     return select_tri_kernel<branchy_box_test>();
+			case box_divide:      return select_tri_kernel<divide_box_test>();
+			case box_reciprocal:  return select_tri_kernel<reciprocal_box_test>();
+			case box_precomputed: return select_tri_kernel<precomputed_box_test>();
+			case box_simd:        return select_tri_kernel<simd_box_test>();
+		}
+	closest_hit_kernel = &binary_bvh_tracer::closest_hit_stack<precomputed_box_test, shirley_tri_test>;
+	any_hit_kernel = &binary_bvh_tracer::any_hit_stack<precomputed_box_test, shirley_tri_test>;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename box_test>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::select_tri_kernel() {
+	auto use = [&](auto tri) {
+		typedef decltype(tri) tri_test;
+		closest_hit_kernel = &binary_bvh_tracer::closest_hit_stack<box_test, tri_test>;
+		any_hit_kernel = &binary_bvh_tracer::any_hit_stack<box_test, tri_test>;
+	};
+	switch (tri_kernel) {
+		case tri_shirley: return use(shirley_tri_test());
+		case tri_moeller: return use(moeller_tri_test());
+		case tri_baldwin: return use(baldwin_tri_test());
+		case tri_woop:    return use(woop_tri_test());
+	}
+}
+
+/* Alle Kombinationen von Box- und Dreieckstest auf denselben Strahlen: Primärstrahlen wie beim Layout-Benchmark und
+ * Schattenstrahlen zwischen zwei zufälligen Punkten der Szene (ohne Verdecker-Cache). Die Dreieckstests kommen nur
+ * zum Zug, wenn die Blätter nicht in SIMD-Blöcken geschnitten werden.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::kernel_benchmark(int rays) {
+	std::vector<::ray> sample(rays), shadow(rays);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	aabb bounds = scene->scene_bounds;
+	auto point = [&]() { return bounds.min + vec3(uniform(rng), uniform(rng), uniform(rng)) * (bounds.max - bounds.min); };
+	for (int i = 0; i < rays; ++i) {
+		vec3 o = point(), d;
+		do d = vec3(uniform(rng), uniform(rng), uniform(rng)) * 2.0f - 1.0f; while (dot(d, d) > 1 || dot(d, d) < 1e-4f);
+		sample[i] = ::ray(o, normalize(d));
+		vec3 p = point();
+		shadow[i] = ::ray(o, normalize(p - o));
+		shadow[i].length_exclusive(length(p - o));
+	}
+	if (triangle_block_width)
+		std::cout << "triangle blocks are on, leaves are intersected in SIMD blocks with every triangle kernel" << std::endl;
+	auto kept_box = box_kernel;
+	auto kept_tri = tri_kernel;
+	auto kept_traversal = traversal_mode;
+	bool kept_cache = use_occluder_cache;
+	traversal_mode = with_stack;
+	use_occluder_cache = false;
+	if (bw_records.empty())
+		build_baldwin_weber_records();
+	for (int b = box_branchy; b <= box_simd; ++b)
+		for (int t = tri_shirley; t <= tri_woop; ++t) {
+			box_kernel = (enum box_kernel)b;
+			tri_kernel = (enum tri_kernel)t;
+			select_kernel();
+			int hits = 0, occluded = 0;
+			auto t1 = std::chrono::high_resolution_clock::now();
+			for (auto &r : sample)
+				if (closest_hit_untimed(r).valid())
+					hits++;
+			auto t2 = std::chrono::high_resolution_clock::now();
+			for (auto &r : shadow)
+				if (any_hit_untimed(r))
+					occluded++;
+			auto t3 = std::chrono::high_resolution_clock::now();
+			float closest_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+			float any_ms = std::chrono::duration<float, std::milli>(t3 - t2).count();
+			std::cout << box_kernel_names[b] << "," << tri_kernel_names[t] << ": "
+			          << rays/closest_ms/1000 << " Mrays/s closest hit (" << hits << " hits), "
+			          << rays/any_ms/1000 << " Mrays/s any hit (" << occluded << " occluded)" << std::endl;
+		}
+	box_kernel = kept_box;
+	tri_kernel = kept_tri;
+	traversal_mode = kept_traversal;
+	use_occluder_cache = kept_cache;
+	select_kernel();
+	if (tri_kernel != tri_baldwin)
+		bw_records.clear();
+}
+
+//! Sortiert die Dreiecke (bzw. den Index) so um, dass die Blätter sie in der Reihenfolge der Knoten referenzieren
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::colocate_leaf_triangles(std::vector<uint32_t> &index) {
+	std::vector<uint32_t> new_index(index.size());
+	uint32_t offset = 0;
+	for (node &n : nodes)
+		if (!n.inner()) {
+			std::copy(index.begin() + n.tri_offset(), index.begin() + n.tri_offset() + n.tri_count(), new_index.begin() + offset);
+			n.tri_offset(offset);
+			offset += n.tri_count();
+		}
+	assert(offset == index.size());
+	index = std::move(new_index);
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+aabb binary_bvh_tracer<tr_layout, esc_mode, node_format>::dequantize(const aabb &frame, const quant_t *lo, const quant_t *hi) {
+	const float steps = std::numeric_limits<quant_t>::max();
+	aabb box;
+	for (int i = 0; i < 3; ++i) {
+		float scale = (frame.max[i] - frame.min[i]) / steps;
+		box.min[i] = frame.min[i] + lo[i] * scale;
+		box.max[i] = frame.max[i] - (steps - hi[i]) * scale;
+	}
+	return box;
+}
+
+/* Überträgt nodes in qnodes. Jede Box wird relativ zur (bereits quantisierten) Box des Elternknotens kodiert, die
+ * Rundung wird dabei mit dequantize überprüft, so dass die dekodierte Box die echte immer umschließt.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::quantize_nodes() {
+	if (node_format == bbvh_node_format::full)
+		return;
+	const int steps = std::numeric_limits<quant_t>::max();
+	qnodes.resize(nodes.size());
+	auto encode = [&](const aabb &frame, const aabb &box, quant_t *lo, quant_t *hi) {
+		for (int i = 0; i < 3; ++i) {
+			float extent = frame.max[i] - frame.min[i];
+			int l = 0, h = steps;
+			if (extent > 0) {
+				l = std::max(0,     std::min(steps, int(floorf((box.min[i] - frame.min[i]) / extent * steps))));
+				h = std::max(0,     std::min(steps, int(ceilf ((box.max[i] - frame.min[i]) / extent * steps))));
+			}
+			lo[i] = l; hi[i] = h;
+			while (lo[i] > 0     && dequantize(frame, lo, hi).min[i] > box.min[i]) lo[i]--;
+			while (hi[i] < steps && dequantize(frame, lo, hi).max[i] < box.max[i]) hi[i]++;
+		}
+		return dequantize(frame, lo, hi);
+	};
+	qroot_box = aabb();
+	if (nodes[root].inner()) {
+		qroot_box = nodes[root].box_l;
+		qroot_box.grow(nodes[root].box_r);
+	}
+	std::vector<std::pair<uint32_t, aabb>> todo { { root, qroot_box } };
+	while (!todo.empty()) {
+		uint32_t id = todo.back().first;
+		aabb frame = todo.back().second;
+		todo.pop_back();
+		const node &n = nodes[id];
+		qnode &q = qnodes[id];
+		q.link_l = n.link_l;
+		q.link_r = n.link_r;
+		if (!n.inner())
+			continue;
+		todo.push_back({ n.link_l, encode(frame, n.box_l, q.lo_l, q.hi_l) });
+		todo.push_back({ n.link_r, encode(frame, n.box_r, q.lo_r, q.hi_r) });
+	}
+}
+
+/* Die Dreiecke in der Reihenfolge, in der die Blätter sie referenzieren (d.h. über den Index aufgelöst), mit den
+ * Positionen direkt im Record. Treffer werden weiterhin über triangle_index auf scene->triangles abgebildet.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::build_triangle_records() {
+	records.clear();
+	blocks4.clear();
+	blocks8.clear();
+	leaf_block.clear();
+	// Die Positionen sind nach einem Build ungültig. Ein Slot je Kern, auch wenn gerade weniger Threads eingestellt sind
+	thread_slots.assign(std::max(omp_get_max_threads(), omp_get_num_procs()), thread_slot());
+	duplicate_references = index.size() > triangles_in_bvh();
+	if (triangle_block_width == 4)
+		build_triangle_blocks(blocks4);
+	else if (triangle_block_width == 8)
+		build_triangle_blocks(blocks8);
+	if (tri_kernel == tri_baldwin)
+		build_baldwin_weber_records();
+	else
+		bw_records.clear();
+	if (!use_triangle_records || triangle_block_width)
+		return;
+	records.resize(index.empty() ? scene->triangles.size() : index.size());
+	#pragma omp parallel for
+	for (size_t i = 0; i < records.size(); ++i) {
+		const triangle &tri = scene->triangles[triangle_index(i)];
+		records[i] = triangle_record(scene->vertices[tri.a].pos, scene->vertices[tri.b].pos, scene->vertices[tri.c].pos);
+	}
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::build_baldwin_weber_records() {
+	bw_records.resize(index.empty() ? scene->triangles.size() : index.size());
+	#pragma omp parallel for
+	for (size_t i = 0; i < bw_records.size(); ++i) {
+		vec3 a, b, c;
+		leaf_triangle(i, a, b, c);
+		bw_records[i] = baldwin_weber_record(a, b, c);
+	}
+}
+
+/* SIMD-Blöcke: jedes Blatt belegt ceil(N/W) aufeinanderfolgende Blöcke (in der Reihenfolge der Knoten), der letzte
+ * wird mit leeren Dreiecken aufgefüllt. leaf_block bildet die erste Position eines Blatts auf seinen ersten Block ab,
+ * so finden auch die Blätter des breiten BVH (die dieselben Positionen referenzieren) ihre Blöcke.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<int W>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::build_triangle_blocks(std::vector<triangle_block<W>> &blocks) {
+	leaf_block.assign(index.empty() ? scene->triangles.size() : index.size(), 0);
+	for (const node &n : nodes) {
+		if (n.inner())
+			continue;
+		leaf_block[n.tri_offset()] = blocks.size();
+		for (int k = 0; k < n.tri_count(); k += W) {
+			triangle_block<W> block = {};
+			for (int j = 0; j < W && k+j < n.tri_count(); ++j) {
+				const triangle &tri = scene->triangles[triangle_index(n.tri_offset()+k+j)];
+				block.set(j, scene->vertices[tri.a].pos, scene->vertices[tri.b].pos, scene->vertices[tri.c].pos);
+			}
+			blocks.push_back(block);
+		}
+	}
+}
+
+//! Bytes, die beim Traversieren gelesen werden (Knoten und Index)
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+size_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::traversal_bytes() const {
+	size_t bytes = index.size() * sizeof(uint32_t) + records.size() * sizeof(triangle_record)
+	             + blocks4.size() * sizeof(triangle_block<4>) + blocks8.size() * sizeof(triangle_block<8>)
+	             + leaf_block.size() * sizeof(uint32_t) + bw_records.size() * sizeof(baldwin_weber_record);
+	if (node_format == bbvh_node_format::full)
+		return bytes + nodes.size() * sizeof(node);
+	return bytes + qnodes.size() * sizeof(qnode);
+}
+
+/* BVH-Cache
+ *
+ * Die Datei enthält nach einem festen Header die Knoten und, je nach Layout, den Index oder die Permutation, mit der
+ * die Dreiecke umsortiert wurden (siehe scene::reorder_triangles), direkt so wie sie im Speicher liegen. Beim Laden
+ * wird sie gemappt und in die Vektoren kopiert. Der Schlüssel (FNV-1a) umfasst Vertexpositionen, Dreiecke und alle
+ * Einstellungen, die das Ergebnis des Aufbaus beeinflussen.
+ */
+namespace {
+	struct bvh_cache_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t root;
+		uint64_t key;
+		uint64_t nodes, index, triangles;
+	};
+	const char bvh_cache_magic[8] = { 'r', 't', 'g', 'i', 'b', 'v', 'h', 0 };
+	const uint32_t bvh_cache_version = 2;
+
+	struct fnv1a {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		void add(const void *data, size_t bytes) {
+			const uint8_t *p = (const uint8_t*)data;
+			for (size_t i = 0; i < bytes; ++i)
+				hash = (hash ^ p[i]) * 0x100000001b3ull;
+		}
+		template<typename T> void add(const T &value) { add(&value, sizeof(T)); }
+	};
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint64_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::cache_key() const {
+	fnv1a h;
+	h.add(int(tr_layout));
+	h.add(int(esc_mode));
+	h.add(int(binary_split_type));
+	h.add(max_triangles_per_node);
+	if (binary_split_type == sah)
+		h.add(number_of_planes);
+	h.add(number_of_bins);
+	h.add(morton_bits);
+	h.add(exact_sweep_below);
+	h.add(cost_traversal);
+	h.add(cost_intersect);
+	h.add(triangle_block_width);
+	h.add(sbvh_alpha);
+	h.add(optimization_passes);
+	h.add(int(node_layout));
+	h.add(treelet_size);
+	h.add(colocate_triangles);
+	h.add(first_triangle);
+	h.add(triangle_count);
+	h.add(uint64_t(scene->vertices.size()));
+	for (const vertex &v : scene->vertices)
+		h.add(v.pos);
+	h.add(uint64_t(scene->triangles.size()));
+	h.add(scene->triangles.data(), scene->triangles.size() * sizeof(triangle));
+	return h.hash;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+std::string binary_bvh_tracer<tr_layout, esc_mode, node_format>::cache_file(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "bvh-%016llx.bin", (unsigned long long)key);
+	return cache_dir + "/" + name;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::load_cache(uint64_t key) {
+	std::string filename = cache_file(key);
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(bvh_cache_header)) {
+		close(fd);
+		return false;
+	}
+	void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+
+	const bvh_cache_header &header = *(const bvh_cache_header*)mapped;
+	const char *data = (const char*)mapped + sizeof(bvh_cache_header);
+	uint64_t expected_size = sizeof(bvh_cache_header) + header.nodes * sizeof(node) + header.index * sizeof(uint32_t)
+	                       + header.triangles * sizeof(uint32_t);
+	bool ok = memcmp(header.magic, bvh_cache_magic, sizeof(bvh_cache_magic)) == 0
+	          && header.version == bvh_cache_version
+	          && header.key == key
+	          && header.nodes > 0
+	          && st.st_size == expected_size
+	          && (tr_layout == bbvh_triangle_layout::flat ? header.triangles == scene->triangles.size() : header.triangles == 0);
+	if (ok) {
+		const node *n = (const node*)data;
+		nodes.assign(n, n + header.nodes);
+		data += header.nodes * sizeof(node);
+		const uint32_t *i = (const uint32_t*)data;
+		index.assign(i, i + header.index);
+		data += header.index * sizeof(uint32_t);
+		if (tr_layout == bbvh_triangle_layout::flat) {
+			const uint32_t *t = (const uint32_t*)data;
+			scene->reorder_triangles(std::vector<uint32_t>(t, t + header.triangles));
+		}
+		root = header.root;
+		sah_cost_after_build = sah_cost();
+	}
+	else
+		std::cerr << "Ignoring stale or broken BVH cache file " << filename << std::endl;
+	munmap(mapped, st.st_size);
+	return ok;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::store_cache(uint64_t key, const std::vector<uint32_t> &order) {
+	bvh_cache_header header;
+	memcpy(header.magic, bvh_cache_magic, sizeof(bvh_cache_magic));
+	header.version = bvh_cache_version;
+	header.root = root;
+	header.key = key;
+	header.nodes = nodes.size();
+	header.index = index.size();
+	header.triangles = tr_layout == bbvh_triangle_layout::flat ? scene->triangles.size() : 0;
+
+	// Erst in eine temporäre Datei schreiben, so sieht ein paralleler Lauf nie eine halbe Datei
+	std::string filename = cache_file(key);
+	std::string tmp = filename + ".tmp" + std::to_string(getpid());
+	std::ofstream out(tmp, std::ios::binary);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)nodes.data(), nodes.size() * sizeof(node));
+	out.write((const char*)index.data(), index.size() * sizeof(uint32_t));
+	if (tr_layout == bbvh_triangle_layout::flat)
+		out.write((const char*)order.data(), order.size() * sizeof(uint32_t));
+	out.close();
+	if (!out || rename(tmp.c_str(), filename.c_str()) != 0) {
+		std::cerr << "Cannot write BVH cache file " << filename << std::endl;
+		remove(tmp.c_str());
+	}
 }
 
 std::vector<aabb> split(std::vector<vec3> poly, float threshold) {
@@ -125,8 +961,8 @@ std::vector<aabb> split(std::vector<vec3> poly, float threshold) {
 	return res;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-void binary_bvh_tracer<tr_layout, esc_mode>::early_split_clipping(std::vector<prim> &prims, std::vector<uint32_t> &index) {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::early_split_clipping(std::vector<prim> &prims, std::vector<uint32_t> &index) {
 	std::vector<prim> stats = prims;
 	auto area = [&](const prim &box) {
 		vec3 extent = box.max - box.min;
@@ -152,61 +988,188 @@ void binary_bvh_tracer<tr_layout, esc_mode>::early_split_clipping(std::vector<pr
 	};
 	int N = prims.size(); // we modify the array as we go, but are only interested in the original elements
 	for (int i = 0; i < N; ++i) {
+		uint32_t tri_index = prims[i].tri_index;
 		std::vector<vec3> poly;
-		poly.push_back(scene->vertices[scene->triangles[index[i]].a].pos);
-		poly.push_back(scene->vertices[scene->triangles[index[i]].b].pos);
-		poly.push_back(scene->vertices[scene->triangles[index[i]].c].pos);
+		poly.push_back(scene->vertices[scene->triangles[tri_index].a].pos);
+		poly.push_back(scene->vertices[scene->triangles[tri_index].b].pos);
+		poly.push_back(scene->vertices[scene->triangles[tri_index].c].pos);
 		
 		std::vector<aabb> generated = split(poly, thres);
 // 		for (int j = 0; j < generated.size(); ++j)
 // 			pbox(generated[j]);
-		prims[i] = prim(generated[0], i);
+		prims[i] = prim(generated[0], tri_index);
 		for (int j = 1; j < generated.size(); ++j) {
-			prims.push_back(prim(generated[j], i));
+			prims.push_back(prim(generated[j], tri_index));
 			index.push_back(prims.size()-1); // they all refer to the same triangle
 		}
 	}
 	std::cout << "ESC " << N << " --> " << prims.size() << " primitives" << std::endl;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
 template<bbvh_triangle_layout LO> 
-typename std::enable_if<LO==bbvh_triangle_layout::flat,void>::type binary_bvh_tracer<tr_layout, esc_mode>::commit_shuffled_triangles(std::vector<prim> &prims,
+typename std::enable_if<LO==bbvh_triangle_layout::flat,void>::type binary_bvh_tracer<tr_layout, esc_mode, node_format>::commit_shuffled_triangles(std::vector<prim> &prims,
 																																	 std::vector<uint32_t> &index) {
-	std::vector<triangle> new_tris(index.size());
-	for (int i = 0; i < new_tris.size(); ++i)
-		new_tris[i] = scene->triangles[index[i]];
-	scene->triangles = std::move(new_tris);
+	scene->reorder_triangles(index);
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
 template<bbvh_triangle_layout LO> 
-typename std::enable_if<LO!=bbvh_triangle_layout::flat,void>::type binary_bvh_tracer<tr_layout, esc_mode>::commit_shuffled_triangles(std::vector<prim> &prims,
+typename std::enable_if<LO!=bbvh_triangle_layout::flat,void>::type binary_bvh_tracer<tr_layout, esc_mode, node_format>::commit_shuffled_triangles(std::vector<prim> &prims,
 																																	 std::vector<uint32_t> &index) {
-	if (esc_mode == bbvh_esc_mode::on)
-		for (int i = 0; i < index.size(); ++i)
-			index[i] = prims[index[i]].tri_index;
+	// with esc or sbvh there are more boxes than triangles
+	for (int i = 0; i < index.size(); ++i)
+		index[i] = prims[index[i]].tri_index;
 	this->index = std::move(index);
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_om(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end) {
+/* Hilfsfunktionen für den (optional parallelen) Aufbau
+ *
+ * Große Bereiche werden in Stücke der Größe parallel_cutoff zerlegt, die als Tasks abgearbeitet werden. Die Funktionen
+ * werden innerhalb des parallelen Bereichs aus build aufgerufen, daher taskloop und nicht parallel for.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+int binary_bvh_tracer<tr_layout, esc_mode, node_format>::chunk_count(uint32_t start, uint32_t end) const {
+	if (!parallel_build || end-start <= parallel_cutoff)
+		return 1;
+	return (end-start + parallel_cutoff-1) / parallel_cutoff;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename F>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::for_each_chunk(uint32_t start, uint32_t end, const F &fn) {
+	int chunks = chunk_count(start, end);
+	if (chunks == 1) {
+		fn(0, start, end);
+		return;
+	}
+	#pragma omp taskloop shared(fn)
+	for (int c = 0; c < chunks; ++c)
+		fn(c, start + c*parallel_cutoff, std::min(end, start + (c+1)*parallel_cutoff));
+}
+
+//! Box über alle (per \c element abgebildete) Primitive im Bereich, \c element liefert eine aabb oder einen Punkt
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename F>
+aabb binary_bvh_tracer<tr_layout, esc_mode, node_format>::bounds(uint32_t start, uint32_t end, const F &element) {
+	std::vector<aabb> part(chunk_count(start, end));
+	for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+		for (uint32_t i = from; i < to; ++i)
+			part[c].grow(element(i));
+	});
+	aabb box;
+	for (auto &b : part)
+		box.grow(b);
+	return box;
+}
+
+//! Wie std::partition, für große Bereiche aber stabil über einen Zwischenspeicher und parallel
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename F>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::partition(std::vector<uint32_t> &index, uint32_t start, uint32_t end, const F &left_side) {
+	int chunks = chunk_count(start, end);
+	if (chunks == 1)
+		return std::partition(index.data()+start, index.data()+end, left_side) - index.data();
+
+	std::vector<uint32_t> left(chunks+1, 0);
+	for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+		for (uint32_t i = from; i < to; ++i)
+			if (left_side(index[i]))
+				left[c+1]++;
+	});
+	for (int c = 0; c < chunks; ++c)
+		left[c+1] += left[c];
+	uint32_t total_left = left[chunks];
+
+	std::vector<uint32_t> scratch(end-start);
+	for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+		uint32_t l = left[c];
+		uint32_t r = total_left + (from-start) - left[c];
+		for (uint32_t i = from; i < to; ++i)
+			if (left_side(index[i])) scratch[l++] = index[i];
+			else                     scratch[r++] = index[i];
+	});
+	for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+		std::copy(scratch.begin()+(from-start), scratch.begin()+(to-start), index.begin()+from);
+	});
+	return start + total_left;
+}
+
+//! Baut die beiden Teilbäume, oberhalb von parallel_cutoff Primitiven wird der linke als eigener Task abgespalten
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename L, typename R>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::fork(uint32_t n, const L &left, const R &right) {
+	if (parallel_build && n > parallel_cutoff) {
+		#pragma omp task shared(left)
+		left();
+		right();
+		#pragma omp taskwait
+	}
+	else {
+		left();
+		right();
+	}
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::make_leaf(uint32_t id, uint32_t start, uint32_t end) {
+	nodes[id].tri_offset(start);
+	nodes[id].tri_count(end - start);
+	return id;
+}
+
+/* Innerer Knoten id über [start,end) mit Teilung bei mid. Der linke Teilbaum bekommt den Bereich direkt hinter id,
+ * der rechte folgt darauf. Die Knoten liegen so in der gleichen Reihenfolge wie beim Anhängen mit emplace_back.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename F>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::make_inner(uint32_t id, uint32_t start, uint32_t mid, uint32_t end, const F &subdivide) {
+	assert(start < mid && mid < end);
+	uint32_t l = id + 1;
+	uint32_t r = id + 2*(mid-start);
+	fork(end-start, [&]() { subdivide(start, mid, l); },
+	                [&]() { subdivide(mid,   end, r); });
+	nodes[id].link_l = l;
+	nodes[id].link_r = r;
+	return id;
+}
+
+//! Entfernt die Lücken, die Blätter mit mehr als einem Dreieck in den reservierten Bereichen lassen
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::compact_nodes() {
+	std::vector<int32_t> new_id(nodes.size());
+	int32_t used = 0;
+	for (int i = 0; i < nodes.size(); ++i) {
+		new_id[i] = used;
+		if (nodes[i].link_r != 0)
+			used++;
+	}
+	if (used == nodes.size())
+		return;
+	for (int i = 0; i < nodes.size(); ++i)
+		if (nodes[i].link_r != 0) {
+			node n = nodes[i];
+			if (n.inner()) {
+				n.link_l = new_id[n.link_l];
+				n.link_r = new_id[n.link_r];
+			}
+			nodes[new_id[i]] = n;
+		}
+	nodes.resize(used);
+	root = new_id[root];
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_om(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id) {
 	assert(start < end);
 	auto p = [&](uint32_t i) { return prims[index[i]]; };
 
 	// Rekursionsabbruch: Nur noch ein Dreieck in der Liste
-	if (end-start <= max_triangles_per_node) {
-		uint32_t id = nodes.size();
-		nodes.emplace_back();
-		nodes[id].tri_offset(start);
-		nodes[id].tri_count(end - start);
-		return id;
-	}
+	if (end-start <= max_triangles_per_node)
+		return make_leaf(id, start, end);
 
 	// Bestimmen der Bounding Box der (Teil-)Szene
-	aabb box;
-	for (int i = start; i < end; ++i)
-		box.grow(p(i));
+	aabb box = bounds(start, end, p);
 
 	// Sortieren nach der größten Achse
 	vec3 extent = box.max - box.min;
@@ -223,59 +1186,34 @@ uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_om(std::vector<prim>
 
 	// In der Mitte zerteilen
 	int mid = start + (end-start)/2;
-	uint32_t id = nodes.size();
-	nodes.emplace_back();
-	uint32_t l = subdivide_om(prims, index, start, mid);
-	uint32_t r = subdivide_om(prims, index, mid,   end);
-	nodes[id].link_l = l;
-	nodes[id].link_r = r;
-	for (int i = start; i < mid; ++i) nodes[id].box_l.grow(p(i));
-	for (int i = mid;   i < end; ++i) nodes[id].box_r.grow(p(i));
+	make_inner(id, start, mid, end, [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_om(prims, index, from, to, at); });
+	nodes[id].box_l = bounds(start, mid, p);
+	nodes[id].box_r = bounds(mid,   end, p);
 	return id;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sm(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end) {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_sm(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id) {
 	assert(start < end);
 	auto p = [&](uint32_t i) { return prims[index[i]]; };
 
 	// Rekursionsabbruch: Nur noch ein Dreieck in der Liste
-	if (end-start <= max_triangles_per_node) {
-		uint32_t id = nodes.size();
-		nodes.emplace_back();
-		nodes[id].tri_offset(start);
-		nodes[id].tri_count(end - start);
-		return id;
-	}
+	if (end-start <= max_triangles_per_node)
+		return make_leaf(id, start, end);
 
 	// Bestimmen der Bounding Box der (Teil-)Szene
-	aabb box;
-	for (int i = start; i < end; ++i)
-		box.grow(p(i));
+	aabb box = bounds(start, end, p);
 
 	// Bestimme und halbiere die größte Achse, sortiere die Dreieck(Schwerpunkt entscheidet) auf die richtige Seite
 	// Nutze Object Median wenn Spatial Median in leeren Knoten resultiert
 	vec3 extent = box.max - box.min;
 	float largest = max(extent.x, max(extent.y, extent.z));
-	float spatial_median;
 	int mid = start;
-	uint32_t* current_left  = index.data() + start;
-	uint32_t* current_right = index.data() + end-1;
 
 	auto sort_sm = [&](auto component_selector) {
 		float spatial_median = component_selector(box.min + (box.max - box.min)*0.5f);
-		while (current_left < current_right) {
-			while (component_selector(prims[*current_left].center()) <= spatial_median && current_left < current_right) {
-				current_left++;
-				mid++;
-			}
-			while (component_selector(prims[*current_right].center()) > spatial_median && current_left < current_right) {
-				current_right--;
-			}
-			if (component_selector(prims[*current_left].center()) > component_selector(prims[*current_right].center()) && current_left < current_right)
-				std::swap(*current_left, *current_right);
-		}
-		if (mid == start || mid == end-1)  {
+		mid = partition(index, start, end, [&](uint32_t i) { return component_selector(prims[i].center()) <= spatial_median; });
+		if (mid == start || mid == end)  {
 			std::sort(index.data()+start, index.data()+end,
 			          [&](uint32_t a, uint32_t b) { return component_selector(prims[a].center()) < component_selector(prims[b].center()); });
 			mid = start + (end-start)/2;
@@ -286,30 +1224,20 @@ uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sm(std::vector<prim>
 	else if (largest == extent.y) sort_sm([](const vec3 &v) { return v.y; });
 	else                          sort_sm([](const vec3 &v) { return v.z; });
 
-	uint32_t id = nodes.size();
-	nodes.emplace_back();
-	uint32_t l = subdivide_sm(prims, index, start, mid);
-	uint32_t r = subdivide_sm(prims, index, mid,   end);
-	nodes[id].link_l = l;
-	nodes[id].link_r = r;
-	for (int i = start; i < mid; ++i) nodes[id].box_l.grow(p(i));
-	for (int i = mid;   i < end; ++i) nodes[id].box_r.grow(p(i));
+	make_inner(id, start, mid, end, [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_sm(prims, index, from, to, at); });
+	nodes[id].box_l = bounds(start, mid, p);
+	nodes[id].box_r = bounds(mid,   end, p);
 	return id;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end) {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id) {
 	assert(start < end);
 	auto p = [&](uint32_t i) { return prims[index[i]]; };
 
 	// Rekursionsabbruch: Nur noch ein Dreieck in der Liste
-	if (end-start <= max_triangles_per_node) {
-		uint32_t id = nodes.size();
-		nodes.emplace_back();
-		nodes[id].tri_offset(start);
-		nodes[id].tri_count(end - start);
-		return id;
-	}
+	if (end-start <= max_triangles_per_node)
+		return make_leaf(id, start, end);
 
 	// Hilfsfunktionen
 	auto box_surface = [&](const aabb &box) {
@@ -318,9 +1246,7 @@ uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sah(std::vector<prim>
 	};
 		
 	// Bestimmen der Bounding Box der (Teil-)Szene
-	aabb box;
-	for (int i = start; i < end; ++i)
-		box.grow(p(i));
+	aabb box = bounds(start, end, p);
 
 	// Teile die Box mit plane, sortiere die Dreiecke(Schwerpunkt entscheidet) auf die richtige Seite
 	// bestimme box links, box rechts mit den jeweiligen kosten
@@ -361,8 +1287,8 @@ uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sah(std::vector<prim>
 		}
 		for (int i = start; i < current_mid; ++i) current_box_l.grow(p(i));
 		for (int i = current_mid;   i < end; ++i) current_box_r.grow(p(i));
-		float sah_cost_current_left = (box_surface(current_box_l)/box_surface(box))*(current_mid-start);
-		float sah_cost_current_right = (box_surface(current_box_r)/box_surface(box))*(end-current_mid);
+		float sah_cost_current_left = (box_surface(current_box_l)/box_surface(box))*intersect_units(current_mid-start);
+		float sah_cost_current_right = (box_surface(current_box_r)/box_surface(box))*intersect_units(end-current_mid);
 		if (sah_cost_current_left + sah_cost_current_right < sah_cost_left + sah_cost_right) {
 			box_l = current_box_l;
 			box_r = current_box_r;
@@ -393,88 +1319,770 @@ uint32_t binary_bvh_tracer<tr_layout, esc_mode>::subdivide_sah(std::vector<prim>
 		}
 	}
 	if (max_triangles_per_node > 1) {
-		if ((K_I*(end - start)) < (K_T + K_I*(sah_cost_left + sah_cost_right)) && (end - start) <= max_triangles_per_node) {
-			uint32_t id = nodes.size();
-			nodes.emplace_back();
-			nodes[id].tri_offset(start);
-			nodes[id].tri_count(end - start);
-			return id;
-		}
+		if ((cost_intersect*intersect_units(end - start)) < (cost_traversal + cost_intersect*(sah_cost_left + sah_cost_right)) && (end - start) <= max_triangles_per_node)
+			return make_leaf(id, start, end);
 	}
-	uint32_t id = nodes.size();
-	nodes.emplace_back();
-	uint32_t l = subdivide_sah(prims, index, start, mid);
-	uint32_t r = subdivide_sah(prims, index, mid,   end);
-	nodes[id].link_l = l;
-	nodes[id].link_r = r;
+	make_inner(id, start, mid, end, [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_sah(prims, index, from, to, at); });
 	nodes[id].box_l = box_l;
 	nodes[id].box_r = box_r;
 	return id;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-triangle_intersection binary_bvh_tracer<tr_layout, esc_mode>::closest_hit(const ray &ray) {
-	time_this_block(closest_hit);
-	triangle_intersection closest, intersection;
-	uint32_t stack[25];
-	int32_t sp = 0;
-	stack[0] = root;
-#ifdef COUNT_HITS
-	unsigned int hits = 0;
-#endif
-	while (sp >= 0) {
-		node node = nodes[stack[sp--]];
-#ifdef COUNT_HITS
-		hits++;
-#endif
-		if (node.inner()) {
-			float dist_l, dist_r;
-			bool hit_l = intersect4(node.box_l, ray, dist_l) && dist_l < closest.t;
-			bool hit_r = intersect4(node.box_r, ray, dist_r) && dist_r < closest.t;
-			if (hit_l && hit_r)
-				if (dist_l < dist_r) {
-					stack[++sp] = node.link_r;
-					stack[++sp] = node.link_l;
-				}
-				else {
-					stack[++sp] = node.link_l;
-					stack[++sp] = node.link_r;
-				}
-			else if (hit_l)
-				stack[++sp] = node.link_l;
-			else if (hit_r)
-				stack[++sp] = node.link_r;
+/* Binned SAH (siehe Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies", 2007)
+ *
+ * Im Gegensatz zu subdivide_sah wird nicht für jede Ebene neu partitioniert, sondern die Schwerpunkte werden in
+ * einem einzigen Durchlauf in number_of_bins Bins entlang der größten Achse (der Schwerpunkte) einsortiert. Die
+ * Kosten aller Bin-Grenzen ergeben sich dann aus einem Prefix- und einem Suffix-Sweep über die Bins.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_binned_sah(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id) {
+	assert(start < end);
+	auto p = [&](uint32_t i) -> const prim& { return prims[index[i]]; };
+
+	// Rekursionsabbruch: Nur noch ein Dreieck in der Liste
+	if (end-start <= max_triangles_per_node)
+		return make_leaf(id, start, end);
+
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+
+	// Bounding Box der Schwerpunkte bestimmt die Achse und die Lage der Bins
+	aabb centroid_box = bounds(start, end, [&](uint32_t i) { return p(i).center(); });
+	vec3 extent = centroid_box.max - centroid_box.min;
+	int axis = 0;
+	if (extent.y > extent[axis]) axis = 1;
+	if (extent.z > extent[axis]) axis = 2;
+
+	// Alle Schwerpunkte liegen aufeinander: hier hilft keine Ebene, also Object Median
+	if (extent[axis] <= 0) {
+		int mid = start + (end-start)/2;
+		make_inner(id, start, mid, end, [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_binned_sah(prims, index, from, to, at); });
+		nodes[id].box_l = bounds(start, mid, p);
+		nodes[id].box_r = bounds(mid,   end, p);
+		return id;
+	}
+
+	// Einsortieren in die Bins (ein Durchlauf, bei großen Knoten pro Stück eigene Bins, die danach vereinigt werden)
+	struct bin_info {
+		aabb box;
+		int count = 0;
+	};
+	const int bins = number_of_bins;
+	const float scale = bins * (1.0f - 1e-6f) / extent[axis];
+	auto bin_of = [&](const prim &prim) {
+		int b = int((prim.center()[axis] - centroid_box.min[axis]) * scale);
+		return b < 0 ? 0 : (b >= bins ? bins-1 : b);
+	};
+	std::vector<bin_info> chunk_bins(chunk_count(start, end) * bins);
+	for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+		bin_info *bin = chunk_bins.data() + c*bins;
+		for (uint32_t i = from; i < to; ++i) {
+			const prim &prim = p(i);
+			int b = bin_of(prim);
+			bin[b].box.grow(prim);
+			bin[b].count++;
 		}
-		else {
-			for (int i = 0; i < node.tri_count(); ++i) {
-				int tri_idx = triangle_index(node.tri_offset()+i);
-				if (intersect(scene->triangles[tri_idx], scene->vertices.data(), ray, intersection))
-					if (intersection.t < closest.t) {
-						closest = intersection;
-						closest.ref = tri_idx;
-					}
-			}
+	});
+	std::vector<bin_info> bin(chunk_bins.begin(), chunk_bins.begin()+bins);
+	for (int c = bins; c < chunk_bins.size(); ++c) {
+		bin[c%bins].box.grow(chunk_bins[c].box);
+		bin[c%bins].count += chunk_bins[c].count;
+	}
+
+	// Prefix-Sweep von links, Suffix-Sweep von rechts
+	// Grenze i liegt zwischen Bin i-1 und Bin i
+	std::vector<aabb> box_left(bins), box_right(bins);
+	std::vector<int> count_left(bins), count_right(bins);
+	aabb acc;
+	int count = 0;
+	for (int i = 1; i < bins; ++i) {
+		acc.grow(bin[i-1].box);
+		count += bin[i-1].count;
+		box_left[i] = acc;
+		count_left[i] = count;
+	}
+	acc = aabb();
+	count = 0;
+	for (int i = bins-1; i > 0; --i) {
+		acc.grow(bin[i].box);
+		count += bin[i].count;
+		box_right[i] = acc;
+		count_right[i] = count;
+	}
+
+	// Günstigste Grenze auswählen
+	float best_cost = FLT_MAX;
+	int best = -1;
+	for (int i = 1; i < bins; ++i) {
+		if (count_left[i] == 0 || count_right[i] == 0)
+			continue;
+		float cost = box_surface(box_left[i])*intersect_units(count_left[i]) + box_surface(box_right[i])*intersect_units(count_right[i]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
 		}
 	}
-#ifdef COUNT_HITS
-	closest.ref = hits;
-#endif
-	return closest;
+	// Da die Schwerpunkte entlang der Achse nicht alle gleich sind, sind erstes und letztes Bin belegt
+	assert(best != -1);
+
+	int mid = partition(index, start, end, [&](uint32_t i) { return bin_of(prims[i]) < best; });
+	assert(mid - start == count_left[best]);
+
+	make_inner(id, start, mid, end, [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_binned_sah(prims, index, from, to, at); });
+	nodes[id].box_l = box_left[best];
+	nodes[id].box_r = box_right[best];
+	return id;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-bool binary_bvh_tracer<tr_layout, esc_mode>::any_hit(const ray &ray) {
-	time_this_block(any_hit);
-	triangle_intersection intersection;
-	uint32_t stack[25];
+/* SAH über alle drei Achsen, für Endbilder bei denen die Qualität wichtiger ist als die Bauzeit
+ *
+ * Kleine Knoten (weniger als exact_sweep_below Primitive) werden exakt ausgewertet: pro Achse werden die Schwerpunkte
+ * sortiert und jede der end-start-1 möglichen Grenzen betrachtet. Größere Knoten werden pro Achse mit number_of_bins
+ * Bins abgeschätzt. Ob überhaupt geteilt wird entscheidet der Vergleich der SAH-Kosten
+ *     K_T + K_I * (A_l*N_l + A_r*N_r) / A
+ * mit den Kosten eines Blatts K_I * N, max_triangles_per_node bleibt dabei die obere Grenze für die Blattgröße.
+ * Werden die Blätter in SIMD-Blöcken geschnitten, zählt N in Blöcken (intersect_units), volle Blöcke sind dann billiger.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_sah_full(std::vector<prim> &prims, std::vector<uint32_t> &index, uint32_t start, uint32_t end, uint32_t id) {
+	assert(start < end);
+	auto p = [&](uint32_t i) -> const prim& { return prims[index[i]]; };
+	const uint32_t n = end-start;
+	if (n == 1)
+		return make_leaf(id, start, end);
+
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	auto subdivide = [&](uint32_t from, uint32_t to, uint32_t at) { subdivide_sah_full(prims, index, from, to, at); };
+
+	aabb box = bounds(start, end, p);
+	float box_area = std::max(box_surface(box), FLT_MIN);
+	float best_cost = FLT_MAX;
+	aabb best_box_l, best_box_r;
+	uint32_t mid = start;
+
+	if (n < exact_sweep_below) {
+		// Exakter Sweep: die günstigste Achse hinterlässt ihre Sortierung in index
+		std::vector<uint32_t> sorted(index.begin()+start, index.begin()+end), best_sorted;
+		std::vector<aabb> box_right(n);
+		for (int axis = 0; axis < 3; ++axis) {
+			std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+				float ca = prims[a].center()[axis], cb = prims[b].center()[axis];
+				return ca < cb || (ca == cb && a < b);
+			});
+			// box_right[i] umschließt sorted[i..n)
+			aabb acc;
+			for (int i = n-1; i > 0; --i) {
+				acc.grow(prims[sorted[i]]);
+				box_right[i] = acc;
+			}
+			acc = aabb();
+			int best_i = -1;
+			for (uint32_t i = 1; i < n; ++i) {
+				acc.grow(prims[sorted[i-1]]);
+				float cost = box_surface(acc)*intersect_units(i) + box_surface(box_right[i])*intersect_units(n-i);
+				cost = cost_traversal + cost_intersect*cost/box_area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_i = i;
+				}
+			}
+			if (best_i != -1) {
+				mid = start + best_i;
+				best_box_r = box_right[best_i];
+				best_sorted = sorted;
+			}
+		}
+		if (cost_intersect*intersect_units(n) <= best_cost && n <= max_triangles_per_node)
+			return make_leaf(id, start, end);
+		std::copy(best_sorted.begin(), best_sorted.end(), index.begin()+start);
+		best_box_l = bounds(start, mid, p);
+	}
+	else {
+		// Gebinnter Sweep über alle Achsen, wie in subdivide_binned_sah
+		aabb centroid_box = bounds(start, end, [&](uint32_t i) { return p(i).center(); });
+		vec3 extent = centroid_box.max - centroid_box.min;
+		struct bin_info {
+			aabb box;
+			int count = 0;
+		};
+		const int bins = number_of_bins;
+		vec3 scale;
+		for (int axis = 0; axis < 3; ++axis)
+			scale[axis] = extent[axis] > 0 ? bins * (1.0f - 1e-6f) / extent[axis] : 0.0f;
+		auto bin_of = [&](const prim &prim, int axis) {
+			int b = int((prim.center()[axis] - centroid_box.min[axis]) * scale[axis]);
+			return b < 0 ? 0 : (b >= bins ? bins-1 : b);
+		};
+		std::vector<bin_info> chunk_bins(chunk_count(start, end) * 3*bins);
+		for_each_chunk(start, end, [&](int c, uint32_t from, uint32_t to) {
+			bin_info *bin = chunk_bins.data() + c*3*bins;
+			for (uint32_t i = from; i < to; ++i) {
+				const prim &prim = p(i);
+				for (int axis = 0; axis < 3; ++axis) {
+					int b = axis*bins + bin_of(prim, axis);
+					bin[b].box.grow(prim);
+					bin[b].count++;
+				}
+			}
+		});
+		std::vector<bin_info> bin(chunk_bins.begin(), chunk_bins.begin()+3*bins);
+		for (int c = 3*bins; c < chunk_bins.size(); ++c) {
+			bin[c%(3*bins)].box.grow(chunk_bins[c].box);
+			bin[c%(3*bins)].count += chunk_bins[c].count;
+		}
+
+		int best_axis = -1, best = -1;
+		std::vector<aabb> box_right(bins);
+		std::vector<int> count_right(bins);
+		for (int axis = 0; axis < 3; ++axis) {
+			if (extent[axis] <= 0)
+				continue;
+			const bin_info *b = bin.data() + axis*bins;
+			aabb acc;
+			int count = 0;
+			for (int i = bins-1; i > 0; --i) {
+				acc.grow(b[i].box);
+				count += b[i].count;
+				box_right[i] = acc;
+				count_right[i] = count;
+			}
+			acc = aabb();
+			count = 0;
+			for (int i = 1; i < bins; ++i) {
+				acc.grow(b[i-1].box);
+				count += b[i-1].count;
+				if (count == 0 || count_right[i] == 0)
+					continue;
+				float cost = box_surface(acc)*intersect_units(count) + box_surface(box_right[i])*intersect_units(count_right[i]);
+				cost = cost_traversal + cost_intersect*cost/box_area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best = i;
+					best_box_l = acc;
+					best_box_r = box_right[i];
+				}
+			}
+		}
+		if (best_axis == -1) {
+			// Alle Schwerpunkte liegen aufeinander
+			if (n <= max_triangles_per_node)
+				return make_leaf(id, start, end);
+			mid = start + n/2;
+			make_inner(id, start, mid, end, subdivide);
+			nodes[id].box_l = bounds(start, mid, p);
+			nodes[id].box_r = bounds(mid,   end, p);
+			return id;
+		}
+		if (cost_intersect*intersect_units(n) <= best_cost && n <= max_triangles_per_node)
+			return make_leaf(id, start, end);
+		mid = partition(index, start, end, [&](uint32_t i) { return bin_of(prims[i], best_axis) < best; });
+	}
+
+	make_inner(id, start, mid, end, subdivide);
+	nodes[id].box_l = best_box_l;
+	nodes[id].box_r = best_box_r;
+	return id;
+}
+
+/* SBVH (Stich, Friedrich, Dietrich, "Spatial Splits in Bounding Volume Hierarchies", 2009)
+ *
+ * Zusätzlich zum (gebinnten) Object Split über alle drei Achsen werden räumliche Splits betrachtet, bei denen
+ * Dreiecke, die die Ebene schneiden, geclippt und in beide Hälften eingetragen werden. Das lohnt sich nur wo sich die
+ * Kinder des Object Splits stark überlappen, daher werden räumliche Splits nur versucht, wenn die Fläche der
+ * Überlappung mehr als sbvh_alpha der Fläche der Wurzel ausmacht (alpha = 0: immer, alpha = 1: praktisch nie).
+ * Anders als ESC werden so nur die Dreiecke geteilt, bei denen es die SAH-Kosten tatsächlich senkt.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::build_sbvh(std::vector<prim> &prims, std::vector<uint32_t> &index) {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	std::vector<prim> refs(index.size()), out;
+	aabb box;
+	for (int i = 0; i < index.size(); ++i) {
+		refs[i] = prims[index[i]];
+		box.grow(refs[i]);
+	}
+	out.reserve(2*refs.size());
+	nodes.clear();
+	uint32_t root = subdivide_sbvh(refs, out, std::max(box_surface(box), FLT_MIN));
+	if (verbose) std::cout << "SBVH " << prims.size() << " --> " << out.size() << " references" << std::endl;
+	prims = std::move(out);
+	index.resize(prims.size());
+	for (int i = 0; i < index.size(); ++i)
+		index[i] = i;
+	return root;
+}
+
+// Teilt die Referenz an der Ebene pos entlang axis, die beiden Boxen umschließen nur den Teil des Dreiecks innerhalb
+// der Referenz. Liegt das Dreieck ganz auf einer Seite, so bleibt die Box der anderen Seite leer.
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::split_reference(const prim &ref, int axis, float pos, aabb &left, aabb &right) {
+	const triangle &tri = scene->triangles[ref.tri_index];
+	const vec3 v[3] = { scene->vertices[tri.a].pos, scene->vertices[tri.b].pos, scene->vertices[tri.c].pos };
+	left = right = aabb();
+	for (int i = 0; i < 3; ++i) {
+		const vec3 &from = v[i], &to = v[(i+1)%3];
+		if (from[axis] <= pos) left.grow(from);
+		if (from[axis] >= pos) right.grow(from);
+		if ((from[axis] < pos && to[axis] > pos) || (from[axis] > pos && to[axis] < pos)) {
+			vec3 x = from + (to-from) * ((pos-from[axis]) / (to[axis]-from[axis]));
+			x[axis] = pos;
+			left.grow(x);
+			right.grow(x);
+		}
+	}
+	auto clip = [&](aabb &box, const vec3 &min, const vec3 &max) {
+		box.min = glm::max(box.min, min);
+		box.max = glm::min(box.max, max);
+		if (box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z)
+			box = aabb();
+	};
+	vec3 left_max = ref.max, right_min = ref.min;
+	left_max[axis] = std::min(left_max[axis], pos);
+	right_min[axis] = std::max(right_min[axis], pos);
+	clip(left, ref.min, left_max);
+	clip(right, right_min, ref.max);
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+uint32_t binary_bvh_tracer<tr_layout, esc_mode, node_format>::subdivide_sbvh(std::vector<prim> &refs, std::vector<prim> &out, float root_area) {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	const uint32_t n = refs.size();
+	uint32_t id = nodes.size();
+	nodes.push_back(unused_node());
+	auto leaf = [&]() {
+		nodes[id].tri_offset(out.size());
+		nodes[id].tri_count(n);
+		out.insert(out.end(), refs.begin(), refs.end());
+		return id;
+	};
+	if (n == 1)
+		return leaf();
+
+	aabb box, centroid_box;
+	for (const prim &ref : refs) {
+		box.grow(ref);
+		centroid_box.grow(ref.center());
+	}
+	float box_area = std::max(box_surface(box), FLT_MIN);
+	const int bins = number_of_bins;
+	struct bin_info {
+		aabb box;
+		int count = 0;     // object split: Schwerpunkte im Bin
+		int entries = 0;   // spatial split: Referenzen, die in diesem Bin beginnen ...
+		int exits = 0;     // ... bzw. enden
+	};
+	std::vector<bin_info> bin(bins);
+	std::vector<aabb> box_right(bins);
+	std::vector<int> count_right(bins);
+
+	// Object Split, gebinnt über alle drei Achsen
+	float best_cost = FLT_MAX;
+	int object_axis = -1, object_bin = -1;
+	aabb object_box_l, object_box_r;
+	vec3 centroid_extent = centroid_box.max - centroid_box.min;
+	auto object_bin_of = [&](const prim &ref, int axis) {
+		int b = int((ref.center()[axis] - centroid_box.min[axis]) * bins * (1.0f - 1e-6f) / centroid_extent[axis]);
+		return b < 0 ? 0 : (b >= bins ? bins-1 : b);
+	};
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centroid_extent[axis] <= 0)
+			continue;
+		std::fill(bin.begin(), bin.end(), bin_info());
+		for (const prim &ref : refs) {
+			int b = object_bin_of(ref, axis);
+			bin[b].box.grow(ref);
+			bin[b].count++;
+		}
+		aabb acc;
+		int count = 0;
+		for (int i = bins-1; i > 0; --i) {
+			acc.grow(bin[i].box);
+			count += bin[i].count;
+			box_right[i] = acc;
+			count_right[i] = count;
+		}
+		acc = aabb();
+		count = 0;
+		for (int i = 1; i < bins; ++i) {
+			acc.grow(bin[i-1].box);
+			count += bin[i-1].count;
+			if (count == 0 || count_right[i] == 0)
+				continue;
+			float cost = box_surface(acc)*intersect_units(count) + box_surface(box_right[i])*intersect_units(count_right[i]);
+			cost = cost_traversal + cost_intersect*cost/box_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				object_axis = axis;
+				object_bin = i;
+				object_box_l = acc;
+				object_box_r = box_right[i];
+			}
+		}
+	}
+
+	// Spatial Split, nur wenn sich die Kinder des Object Splits nennenswert überlappen
+	int spatial_axis = -1, spatial_bin = -1;
+	vec3 extent = box.max - box.min;
+	auto plane = [&](int axis, int i) { return box.min[axis] + i * extent[axis] / bins; };
+	auto spatial_bin_of = [&](float x, int axis) {
+		int b = int((x - box.min[axis]) * bins * (1.0f - 1e-6f) / extent[axis]);
+		return b < 0 ? 0 : (b >= bins ? bins-1 : b);
+	};
+	aabb overlap;
+	overlap.min = glm::max(object_box_l.min, object_box_r.min);
+	overlap.max = glm::min(object_box_l.max, object_box_r.max);
+	bool overlapping = object_axis == -1 ||
+	                   (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z &&
+	                    box_surface(overlap) > sbvh_alpha * root_area);
+	if (overlapping)
+		for (int axis = 0; axis < 3; ++axis) {
+			if (extent[axis] <= 0)
+				continue;
+			std::fill(bin.begin(), bin.end(), bin_info());
+			for (const prim &ref : refs) {
+				int first = spatial_bin_of(ref.min[axis], axis);
+				int last  = spatial_bin_of(ref.max[axis], axis);
+				bin[first].entries++;
+				bin[last].exits++;
+				// Referenz Bin für Bin abschneiden
+				prim rest = ref;
+				for (int b = first; b < last; ++b) {
+					aabb l, r;
+					split_reference(rest, axis, plane(axis, b+1), l, r);
+					bin[b].box.grow(l);
+					rest = prim(r, ref.tri_index);
+				}
+				bin[last].box.grow(rest);
+			}
+			aabb acc;
+			int count = 0;
+			for (int i = bins-1; i > 0; --i) {
+				acc.grow(bin[i].box);
+				count += bin[i].exits;
+				box_right[i] = acc;
+				count_right[i] = count;
+			}
+			acc = aabb();
+			count = 0;
+			for (int i = 1; i < bins; ++i) {
+				acc.grow(bin[i-1].box);
+				count += bin[i-1].entries;
+				// Keine Seite darf alle Referenzen behalten, sonst terminiert die Rekursion nicht
+				if (count == 0 || count_right[i] == 0 || count == n || count_right[i] == n)
+					continue;
+				float cost = box_surface(acc)*intersect_units(count) + box_surface(box_right[i])*intersect_units(count_right[i]);
+				cost = cost_traversal + cost_intersect*cost/box_area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					spatial_axis = axis;
+					spatial_bin = i;
+				}
+			}
+		}
+
+	if (object_axis == -1 && spatial_axis == -1) {
+		// Alle Schwerpunkte liegen aufeinander und kein räumlicher Split hilft
+		if (n <= max_triangles_per_node)
+			return leaf();
+	}
+	else if (cost_intersect*intersect_units(n) <= best_cost && n <= max_triangles_per_node)
+		return leaf();
+
+	std::vector<prim> left, right;
+	if (spatial_axis != -1) {
+		const int axis = spatial_axis;
+		const float pos = plane(axis, spatial_bin);
+		std::vector<prim> straddling;
+		aabb box_l, box_r;
+		for (const prim &ref : refs) {
+			if (spatial_bin_of(ref.max[axis], axis) < spatial_bin)        { left.push_back(ref);  box_l.grow(ref); }
+			else if (spatial_bin_of(ref.min[axis], axis) >= spatial_bin)  { right.push_back(ref); box_r.grow(ref); }
+			else straddling.push_back(ref);
+		}
+		// Reference Unsplitting: eine Referenz, die beide Seiten berührt, wird nur geteilt, wenn das günstiger ist
+		// als sie vollständig einer Seite zuzuordnen
+		int count_l = left.size() + straddling.size(), count_r = right.size() + straddling.size();
+		for (const prim &ref : straddling) {
+			aabb l, r;
+			split_reference(ref, axis, pos, l, r);
+			aabb box_l_split = box_l, box_r_split = box_r, box_l_whole = box_l, box_r_whole = box_r;
+			box_l_split.grow(l);
+			box_r_split.grow(r);
+			box_l_whole.grow(ref);
+			box_r_whole.grow(ref);
+			float cost_split = box_surface(box_l_split)*count_l + box_surface(box_r_split)*count_r;
+			float cost_left  = box_surface(box_l_whole)*count_l + box_surface(box_r)*(count_r-1);
+			float cost_right = box_surface(box_l)*(count_l-1) + box_surface(box_r_whole)*count_r;
+			if (l.min.x > l.max.x) cost_split = cost_left = FLT_MAX;    // numerisch nur rechts
+			if (r.min.x > r.max.x) cost_split = cost_right = FLT_MAX;   // numerisch nur links
+			if (cost_split <= cost_left && cost_split <= cost_right) {
+				left.push_back(prim(l, ref.tri_index));
+				right.push_back(prim(r, ref.tri_index));
+				box_l = box_l_split;
+				box_r = box_r_split;
+			}
+			else if (cost_left <= cost_right) {
+				left.push_back(ref);
+				box_l = box_l_whole;
+				count_r--;
+			}
+			else {
+				right.push_back(ref);
+				box_r = box_r_whole;
+				count_l--;
+			}
+		}
+		if (left.size() == 0 || right.size() == 0 || left.size() == n || right.size() == n) {
+			// kommt nur durch numerische Sonderfälle zustande, dann doch lieber der Object Split
+			left.clear();
+			right.clear();
+			spatial_axis = -1;
+		}
+	}
+	if (spatial_axis == -1) {
+		if (object_axis != -1) {
+			for (const prim &ref : refs)
+				(object_bin_of(ref, object_axis) < object_bin ? left : right).push_back(ref);
+		}
+		else {
+			left.assign(refs.begin(), refs.begin() + n/2);
+			right.assign(refs.begin() + n/2, refs.end());
+		}
+	}
+	std::vector<prim>().swap(refs);
+
+	aabb box_l, box_r;
+	for (const prim &ref : left)  box_l.grow(ref);
+	for (const prim &ref : right) box_r.grow(ref);
+	uint32_t l = subdivide_sbvh(left, out, root_area);
+	uint32_t r = subdivide_sbvh(right, out, root_area);
+	nodes[id].link_l = l;
+	nodes[id].link_r = r;
+	nodes[id].box_l = box_l;
+	nodes[id].box_r = box_r;
+	return id;
+}
+
+/* LBVH
+ *
+ * Die Primitive werden nach dem Morton-Code ihres Schwerpunkts sortiert, die Hierarchie ergibt sich dann direkt aus den
+ * gemeinsamen Präfixen benachbarter Codes (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and
+ * k-d Trees", 2012). Jeder innere Knoten kann dabei unabhängig von allen anderen bestimmt werden.
+ */
+
+//! Fügt zwischen die unteren 10 Bit von \c v jeweils zwei Nullen ein
+static inline uint32_t expand_bits(uint32_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v <<  8)) & 0x0300f00f;
+	v = (v | (v <<  4)) & 0x030c30c3;
+	v = (v | (v <<  2)) & 0x09249249;
+	return v;
+}
+
+//! Fügt zwischen die unteren 21 Bit von \c v jeweils zwei Nullen ein
+static inline uint64_t expand_bits(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x001f00000000ffffull;
+	v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+	v = (v | (v <<  8)) & 0x100f00f00f00f00full;
+	v = (v | (v <<  4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v <<  2)) & 0x1249249249249249ull;
+	return v;
+}
+
+static inline int leading_zeros(uint32_t v) { return v == 0 ? 32 : __builtin_clz(v); }
+static inline int leading_zeros(uint64_t v) { return v == 0 ? 64 : __builtin_clzll(v); }
+
+/* LSD Radix-Sort mit 8 Bit pro Durchgang. Jeder Thread zählt die Ziffern seines (statischen) Teils der Schlüssel,
+ * daraus ergeben sich die Zielpositionen und jeder Thread verteilt danach den gleichen Teil (stabil) um.
+ */
+template<typename code_t>
+static void radix_sort(std::vector<code_t> &keys, std::vector<uint32_t> &values, int bits) {
+	const int n = keys.size();
+	std::vector<code_t> keys_tmp(n);
+	std::vector<uint32_t> values_tmp(n);
+	std::vector<uint32_t> histogram(omp_get_max_threads() * 256);
+	for (int shift = 0; shift < bits; shift += 8) {
+		#pragma omp parallel
+		{
+			const int threads = omp_get_num_threads();
+			const int t = omp_get_thread_num();
+			uint32_t *hist = histogram.data() + t*256;
+			std::fill(hist, hist+256, 0);
+			#pragma omp for schedule(static)
+			for (int i = 0; i < n; ++i)
+				hist[(keys[i] >> shift) & 0xff]++;
+			#pragma omp single
+			{
+				uint32_t offset = 0;
+				for (int digit = 0; digit < 256; ++digit)
+					for (int j = 0; j < threads; ++j) {
+						uint32_t count = histogram[j*256 + digit];
+						histogram[j*256 + digit] = offset;
+						offset += count;
+					}
+			}
+			#pragma omp for schedule(static)
+			for (int i = 0; i < n; ++i) {
+				uint32_t pos = hist[(keys[i] >> shift) & 0xff]++;
+				keys_tmp[pos] = keys[i];
+				values_tmp[pos] = values[i];
+			}
+		}
+		std::swap(keys, keys_tmp);
+		std::swap(values, values_tmp);
+	}
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename code_t>
+std::vector<typename binary_bvh_tracer<tr_layout, esc_mode, node_format>::lbvh_node>
+binary_bvh_tracer<tr_layout, esc_mode, node_format>::lbvh_hierarchy(std::vector<prim> &prims, std::vector<uint32_t> &index, int bits_per_axis) {
+	const int n = index.size();
+	aabb centroid_box;
+	for (int i = 0; i < n; ++i)
+		centroid_box.grow(prims[index[i]].center());
+	vec3 extent = centroid_box.max - centroid_box.min;
+	vec3 scale((1<<bits_per_axis)-1);
+	for (int i = 0; i < 3; ++i)
+		scale[i] = extent[i] > 0 ? scale[i] / extent[i] : 0.0f;
+
+	// Morton-Codes berechnen und sortieren
+	std::vector<code_t> codes(n);
+	#pragma omp parallel for
+	for (int i = 0; i < n; ++i) {
+		vec3 q = (prims[index[i]].center() - centroid_box.min) * scale;
+		codes[i] = (expand_bits(code_t(q.x)) << 2) | (expand_bits(code_t(q.y)) << 1) | expand_bits(code_t(q.z));
+	}
+	radix_sort(codes, index, 3*bits_per_axis);
+
+	// Länge des gemeinsamen Präfixes, bei gleichen Codes entscheidet die Position
+	const int code_bits = 8*sizeof(code_t);
+	auto delta = [&](int i, int j) {
+		if (j < 0 || j >= n) return -1;
+		if (codes[i] == codes[j]) return code_bits + leading_zeros(uint32_t(i ^ j));
+		return leading_zeros(code_t(codes[i] ^ codes[j]));
+	};
+
+	std::vector<lbvh_node> hierarchy(n > 1 ? n-1 : 0);
+	#pragma omp parallel for
+	for (int i = 0; i < n-1; ++i) {
+		// Richtung des Bereichs
+		int d = delta(i, i+1) - delta(i, i-1) > 0 ? 1 : -1;
+		int delta_min = delta(i, i-d);
+		// Obere Schranke für die Länge, dann binäre Suche nach dem anderen Ende
+		int l_max = 2;
+		while (delta(i, i + l_max*d) > delta_min)
+			l_max *= 2;
+		int l = 0;
+		for (int t = l_max/2; t >= 1; t /= 2)
+			if (delta(i, i + (l+t)*d) > delta_min)
+				l += t;
+		int j = i + l*d;
+		// Binäre Suche nach der Stelle, an der sich der gemeinsame Präfix des Bereichs ändert
+		int delta_node = delta(i, j);
+		int s = 0;
+		for (int t = (l+1)/2; ; t = (t+1)/2) {
+			if (delta(i, i + (s+t)*d) > delta_node)
+				s += t;
+			if (t == 1) break;
+		}
+		hierarchy[i].first = std::min(i, j);
+		hierarchy[i].last  = std::max(i, j);
+		hierarchy[i].split = i + s*d + std::min(d, 0);
+	}
+	return hierarchy;
+}
+
+/* Überträgt den Teilbaum über die sortierten Primitive [first,last] in das Knotenformat, Bereiche mit höchstens
+ * max_triangles_per_node Primitiven werden zu einem Blatt zusammengefasst. Liefert die Box des Teilbaums.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+aabb binary_bvh_tracer<tr_layout, esc_mode, node_format>::emit_lbvh(std::vector<prim> &prims, std::vector<uint32_t> &index,
+                                                       const std::vector<lbvh_node> &hierarchy,
+                                                       uint32_t first, uint32_t last, uint32_t id) {
+	if (last-first+1 <= max_triangles_per_node) {
+		make_leaf(id, first, last+1);
+		return bounds(first, last+1, [&](uint32_t i) { return prims[index[i]]; });
+	}
+	// Der innere Knoten eines Bereichs mit mehr als einem Element hat Index first oder last
+	const lbvh_node &inner = hierarchy[first].first == first && hierarchy[first].last == last ? hierarchy[first] : hierarchy[last];
+	assert(inner.first == first && inner.last == last);
+	uint32_t split = inner.split;
+	uint32_t l = id + 1;
+	uint32_t r = id + 2*(split-first+1);
+	fork(last-first+1, [&]() { nodes[id].box_l = emit_lbvh(prims, index, hierarchy, first,   split, l); },
+	                   [&]() { nodes[id].box_r = emit_lbvh(prims, index, hierarchy, split+1, last,  r); });
+	nodes[id].link_l = l;
+	nodes[id].link_r = r;
+	aabb box = nodes[id].box_l;
+	box.grow(nodes[id].box_r);
+	return box;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+triangle_intersection binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit(const ray &ray) {
+	time_this_block(closest_hit);
+	return closest_hit_untimed(ray);
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+triangle_intersection binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit_untimed(const ray &ray) {
+	mailbox mb;
+	mailbox *use_mb = mailboxing() ? &mb : nullptr;
+	triangle_intersection closest;
+	if (node_format != bbvh_node_format::full)
+		closest = closest_hit_quantized(ray, use_mb);
+	else if (traversal_mode == restart_trail && levels <= 64)
+		closest = closest_hit_restart_trail(ray, use_mb);
+	else
+		closest = (this->*closest_hit_kernel)(ray, use_mb);
+	if (mb.skipped)
+		if (thread_slot *slot = this_thread_slot())
+			slot->mailbox_skipped += mb.skipped;
+	return closest;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+auto binary_bvh_tracer<tr_layout, esc_mode, node_format>::this_thread_slot() -> thread_slot* {
+	// Laufen mehr Threads als beim Aufbau Slots angelegt wurden, bekommen die übrigen keinen (und keinen Occluder-Cache):
+	// ein geteilter Slot wäre ein Data Race, und wachsen kann der Vektor nicht, während andere Threads ihn benutzen.
+	unsigned id = omp_get_thread_num();
+	return id < thread_slots.size() ? &thread_slots[id] : nullptr;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename box_test, typename tri_test>
+triangle_intersection binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit_stack(const ray &ray, mailbox *mb) {
+	triangle_intersection closest;
+	traversal_stack<uint32_t> stack(levels);
 	int32_t sp = 0;
 	stack[0] = root;
+#ifdef COUNT_HITS
+	unsigned int hits = 0;
+#endif
 	while (sp >= 0) {
 		node node = nodes[stack[sp--]];
+#ifdef COUNT_HITS
+		hits++;
+#endif
 		if (node.inner()) {
 			float dist_l, dist_r;
-			bool hit_l = intersect4(node.box_l, ray, dist_l);
-			bool hit_r = intersect4(node.box_r, ray, dist_r);
+			bool hit_l = box_test::test(node.box_l, ray, dist_l) && dist_l < closest.t;
+			bool hit_r = box_test::test(node.box_r, ray, dist_r) && dist_r < closest.t;
 			if (hit_l && hit_r)
 				if (dist_l < dist_r) {
 					stack[++sp] = node.link_r;
@@ -490,27 +2098,418 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::any_hit(const ray &ray) {
 				stack[++sp] = node.link_r;
 		}
 		else {
-			for (int i = 0; i < node.tri_count(); ++i) {
-				int tri_idx = triangle_index(node.tri_offset()+i);
-				if (intersect(scene->triangles[tri_idx], scene->vertices.data(), ray, intersection))
-					return true;
+			intersect_leaf<tri_test>(node.tri_offset(), node.tri_count(), ray, closest, mb);
+		}
+	}
+#ifdef COUNT_HITS
+	closest.ref = hits;
+#endif
+	return closest;
+}
+
+/* Paket-Traversierung (Wald et al., "Interactive Rendering with Coherent Ray Tracing", 2001; Boulos et al.,
+ * "Packet-based Whitted and Distribution Ray Tracing", 2007)
+ *
+ * Alle Strahlen des Pakets laufen gemeinsam durch den Baum, zu jedem Knoten auf dem Stack gehört die Maske der
+ * Strahlen, die ihn treffen. Jede Box wird zuerst mit Intervallarithmetik gegen das ganze Paket getestet (Ursprung und
+ * inverse Richtung als Intervall über alle Strahlen, auf Achsen mit gemischtem Vorzeichen der Richtung wird nicht
+ * gefiltert). Verfehlt das Paket sie sicher, entfallen die Einzeltests, sonst werden die aktiven Strahlen in Gruppen zu
+ * 8 per SIMD getestet. Die Kinder werden in Richtung des ersten aktiven Strahls entlang der Achse besucht, auf der ihre
+ * Mittelpunkte am weitesten auseinanderliegen.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit_packet(const ray_packet &packet, triangle_intersection *closest) {
+	time_this_block(closest_hit_packet);
+	if (node_format != bbvh_node_format::full || !packet_traversal) {
+		for (unsigned i = 0; i < packet.n; ++i)
+			closest[i] = closest_hit_untimed(packet.rays[i]);
+		return;
+	}
+	typedef lanes<8> L;
+	constexpr unsigned size = ray_packet::size;
+	static_assert(size % 8 == 0 && size <= 64, "the active rays of a packet are kept in a 64 bit mask");
+	alignas(32) float ox[size], oy[size], oz[size], ix[size], iy[size], iz[size], t_min[size], t_max[size];
+	vec3 o_lo(FLT_MAX), o_hi(-FLT_MAX), id_lo(FLT_MAX), id_hi(-FLT_MAX);
+	float packet_t_min = FLT_MAX, packet_t_max = 0;
+	for (unsigned i = 0; i < size; ++i) {
+		// Unbenutzte Plätze wiederholen den ersten Strahl, ihr Bit ist nie gesetzt
+		const ray &ray = packet.rays[i < packet.n ? i : 0];
+		ox[i] = ray.o.x;  oy[i] = ray.o.y;  oz[i] = ray.o.z;
+		ix[i] = ray.id.x; iy[i] = ray.id.y; iz[i] = ray.id.z;
+		t_min[i] = ray.t_min;
+		t_max[i] = ray.t_max;
+		o_lo = min(o_lo, ray.o);   o_hi = max(o_hi, ray.o);
+		id_lo = min(id_lo, ray.id); id_hi = max(id_hi, ray.id);
+		packet_t_min = std::min(packet_t_min, ray.t_min);
+		packet_t_max = std::max(packet_t_max, ray.t_max);
+	}
+	for (unsigned i = 0; i < packet.n; ++i)
+		closest[i] = triangle_intersection();
+	// Je Strahl eine Mailbox, nur angelegt, wenn Dreiecke in mehreren Blättern vorkommen
+	std::unique_ptr<mailbox[]> mb(mailboxing() ? new mailbox[size] : nullptr);
+	bool same_sign[3];
+	for (int a = 0; a < 3; ++a)
+		same_sign[a] = std::isfinite(id_lo[a]) && std::isfinite(id_hi[a]) && id_lo[a]*id_hi[a] > 0;
+
+	auto packet_misses = [&](const aabb &box) {
+		float t_near = packet_t_min, t_far = packet_t_max;
+		for (int a = 0; a < 3; ++a) {
+			if (!same_sign[a])
+				continue;
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (float dist_lo : { box.min[a] - o_hi[a], box.max[a] - o_hi[a] }) {
+				float dist_hi = dist_lo + (o_hi[a] - o_lo[a]);
+				for (float t : { dist_lo*id_lo[a], dist_lo*id_hi[a], dist_hi*id_lo[a], dist_hi*id_hi[a] }) {
+					lo = std::min(lo, t);
+					hi = std::max(hi, t);
+				}
+			}
+			t_near = std::max(t_near, lo);
+			t_far = std::min(t_far, hi);
+		}
+		return t_near > t_far;
+	};
+	auto hit_mask = [&](const aabb &box, uint64_t active) {
+		L::f min_x = L::set1(box.min.x), min_y = L::set1(box.min.y), min_z = L::set1(box.min.z);
+		L::f max_x = L::set1(box.max.x), max_y = L::set1(box.max.y), max_z = L::set1(box.max.z);
+		uint64_t hit = 0;
+		for (unsigned g = 0; g < size; g += 8) {
+			if (!((active >> g) & 0xff))
+				continue;
+			L::f o_x = L::load(ox+g), o_y = L::load(oy+g), o_z = L::load(oz+g);
+			L::f i_x = L::load(ix+g), i_y = L::load(iy+g), i_z = L::load(iz+g);
+			L::f t1x = L::mul(L::sub(min_x, o_x), i_x), t2x = L::mul(L::sub(max_x, o_x), i_x);
+			L::f t1y = L::mul(L::sub(min_y, o_y), i_y), t2y = L::mul(L::sub(max_y, o_y), i_y);
+			L::f t1z = L::mul(L::sub(min_z, o_z), i_z), t2z = L::mul(L::sub(max_z, o_z), i_z);
+			L::f t_near = L::max(L::max(L::min(t1x, t2x), L::min(t1y, t2y)), L::max(L::min(t1z, t2z), L::load(t_min+g)));
+			L::f t_far  = L::min(L::min(L::max(t1x, t2x), L::max(t1y, t2y)), L::min(L::max(t1z, t2z), L::load(t_max+g)));
+			hit |= uint64_t(L::le(t_near, t_far)) << g;
+		}
+		return hit & active;
+	};
+
+	struct entry {
+		uint32_t node;
+		uint64_t active;
+	};
+	traversal_stack<entry> stack(levels);
+	int32_t sp = 0;
+	stack[0] = { root, packet.n == 64 ? ~uint64_t(0) : (uint64_t(1) << packet.n) - 1 };
+	while (sp >= 0) {
+		entry e = stack[sp--];
+		const node &node = nodes[e.node];
+		if (node.inner()) {
+			uint64_t hit_l = packet_misses(node.box_l) ? 0 : hit_mask(node.box_l, e.active);
+			uint64_t hit_r = packet_misses(node.box_r) ? 0 : hit_mask(node.box_r, e.active);
+			if (hit_l && hit_r) {
+				vec3 delta = (node.box_r.min + node.box_r.max) - (node.box_l.min + node.box_l.max);
+				vec3 extent = abs(delta);
+				int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+				if (delta[axis] * packet.rays[__builtin_ctzll(e.active)].d[axis] >= 0) {
+					stack[++sp] = { uint32_t(node.link_r), hit_r };
+					stack[++sp] = { uint32_t(node.link_l), hit_l };
+				}
+				else {
+					stack[++sp] = { uint32_t(node.link_l), hit_l };
+					stack[++sp] = { uint32_t(node.link_r), hit_r };
+				}
 			}
+			else if (hit_l)
+				stack[++sp] = { uint32_t(node.link_l), hit_l };
+			else if (hit_r)
+				stack[++sp] = { uint32_t(node.link_r), hit_r };
+		}
+		else {
+			for (uint64_t active = e.active; active; active &= active-1) {
+				int i = __builtin_ctzll(active);
+				intersect_leaf(node.tri_offset(), node.tri_count(), packet.rays[i], closest[i], mb ? &mb[i] : nullptr);
+				t_max[i] = std::min(t_max[i], closest[i].t);
+			}
+			packet_t_max = 0;
+			for (unsigned i = 0; i < packet.n; ++i)
+				packet_t_max = std::max(packet_t_max, t_max[i]);
+		}
+	}
+	if (mb) {
+		uint64_t skipped = 0;
+		for (unsigned i = 0; i < packet.n; ++i)
+			skipped += mb[i].skipped;
+		if (thread_slot *slot = this_thread_slot())
+			slot->mailbox_skipped += skipped;
+	}
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::any_hit(const ray &ray) {
+	time_this_block(any_hit);
+	return any_hit_untimed(ray);
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::any_hit_untimed(const ray &ray) {
+	// Das Dreieck, das den letzten Schattenstrahl dieses Threads blockiert hat, blockiert oft auch den nächsten
+	thread_slot *slot = this_thread_slot();
+	if (use_occluder_cache && slot) {
+		slot->occluder_tests++;
+		triangle_intersection intersection;
+		if (slot->occluder >= 0 && intersect_leaf_triangle(slot->occluder, ray, intersection)) {
+			slot->occluder_hits++;
+			return true;
+		}
+	}
+	mailbox mb;
+	mailbox *use_mb = mailboxing() ? &mb : nullptr;
+	int32_t blocker = -1;
+	bool occluded;
+	if (node_format != bbvh_node_format::full)
+		occluded = any_hit_quantized(ray, blocker, use_mb);
+	else if (traversal_mode == restart_trail && levels <= 64)
+		occluded = any_hit_restart_trail(ray, blocker, use_mb);
+	else
+		occluded = (this->*any_hit_kernel)(ray, blocker, use_mb);
+	if (slot) {
+		if (occluded && use_occluder_cache)
+			slot->occluder = blocker;
+		slot->mailbox_skipped += mb.skipped;
+	}
+	return occluded;
+}
+
+/* Verdeckungstest mit Stack: es genügt irgendein Treffer, die Kinder müssen also nicht nach Entfernung sortiert
+ * werden. Mit occlusion_order == by_axis wird zuerst das Kind besucht, das entlang der Hauptachse des Strahls (der
+ * Achse mit der kürzesten inversen Richtung) vorne liegt, was nur von den Boxen abhängt, unordered nimmt immer zuerst
+ * das linke Kind. by_distance entspricht der Reihenfolge von closest_hit, braucht dafür aber die Eintrittsdistanzen
+ * und ist deshalb nicht der Standard.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+template<typename box_test, typename tri_test>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::any_hit_stack(const ray &ray, int32_t &blocker, mailbox *mb) {
+	vec3 dir = abs(ray.d);
+	int axis = dir.x > dir.y ? (dir.x > dir.z ? 0 : 2) : (dir.y > dir.z ? 1 : 2);
+	bool positive = ray.d[axis] >= 0;
+	traversal_stack<uint32_t> stack(levels);
+	int32_t sp = 0;
+	stack[0] = root;
+	while (sp >= 0) {
+		node node = nodes[stack[sp--]];
+		if (node.inner()) {
+			float dist_l = 0, dist_r = 0;
+			bool hit_l = box_test::test(node.box_l, ray, dist_l);
+			bool hit_r = box_test::test(node.box_r, ray, dist_r);
+			if (hit_l && hit_r) {
+				bool left_first = true;
+				if (occlusion_order == by_distance)
+					left_first = dist_l < dist_r;
+				else if (occlusion_order == by_axis)
+					left_first = (node.box_l.min[axis] + node.box_l.max[axis] <= node.box_r.min[axis] + node.box_r.max[axis]) == positive;
+				if (left_first) {
+					stack[++sp] = node.link_r;
+					stack[++sp] = node.link_l;
+				}
+				else {
+					stack[++sp] = node.link_l;
+					stack[++sp] = node.link_r;
+				}
+			}
+			else if (hit_l)
+				stack[++sp] = node.link_l;
+			else if (hit_r)
+				stack[++sp] = node.link_r;
+		}
+		else {
+			if (any_hit_leaf<tri_test>(node.tri_offset(), node.tri_count(), ray, &blocker, mb))
+				return true;
 		}
 	}
 	return false;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &command, std::istringstream &in) {
+/* Stackless Traversierung mit Restart Trail (Laine, "Restart Trail for Stackless BVH Traversal", 2010)
+ *
+ * Statt eines Stacks gibt es ein Bit pro Ebene: 0 heißt, dass unter dem Knoten dieser Ebene noch das erste (nähere)
+ * Kind bearbeitet wird, 1, dass es das zweite (bzw. einzige) ist. Ist ein Teilbaum fertig, wird die tiefste Ebene mit
+ * 0 auf 1 gesetzt, alle tieferen gelöscht und wieder bei der Wurzel begonnen. Die Reihenfolge der Kinder hängt nur von
+ * den Boxen ab (nicht vom bisher nächsten Treffer), sonst würde der Weg beim Neustart nicht mehr zum Trail passen.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+triangle_intersection binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit_restart_trail(const ray &ray, mailbox *mb) {
+	triangle_intersection closest;
+	uint64_t trail = 0;
+	uint32_t id = root, level = 0;
+	while (true) {
+		const node &node = nodes[id];
+		if (node.inner()) {
+			float dist_l, dist_r;
+			bool hit_l = intersect4(node.box_l, ray, dist_l);
+			bool hit_r = intersect4(node.box_r, ray, dist_r);
+			if (hit_l || hit_r) {
+				uint64_t bit = uint64_t(1) << level;
+				uint32_t first = node.link_l, second = node.link_r;
+				float dist_first = dist_l, dist_second = dist_r;
+				if (!hit_l || (hit_r && dist_r <= dist_l)) {
+					std::swap(first, second);
+					std::swap(dist_first, dist_second);
+				}
+				if (!hit_l || !hit_r) {
+					second = first;
+					dist_second = dist_first;
+				}
+				if (!(trail & bit)) {
+					if (second != first && dist_first < closest.t) {
+						id = first;
+						level++;
+						continue;
+					}
+					// Nur ein Kind oder das erste liegt hinter dem bisherigen Treffer, weiter mit dem zweiten
+					trail = (trail & (bit-1)) | bit;
+				}
+				if (dist_second < closest.t) {
+					id = second;
+					level++;
+					continue;
+				}
+			}
+		}
+		else {
+			intersect_leaf(node.tri_offset(), node.tri_count(), ray, closest, mb);
+		}
+		// Teilbaum fertig: tiefste Ebene darüber, deren zweites Kind noch aussteht
+		uint64_t open = ~trail & ((uint64_t(1) << level) - 1);
+		if (!open)
+			break;
+		int j = 63 - __builtin_clzll(open);
+		trail = (trail & ((uint64_t(1) << j) - 1)) | (uint64_t(1) << j);
+		id = root;
+		level = 0;
+	}
+	return closest;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::any_hit_restart_trail(const ray &ray, int32_t &blocker, mailbox *mb) {
+	uint64_t trail = 0;
+	uint32_t id = root, level = 0;
+	while (true) {
+		const node &node = nodes[id];
+		if (node.inner()) {
+			float dist_l, dist_r;
+			bool hit_l = intersect4(node.box_l, ray, dist_l);
+			bool hit_r = intersect4(node.box_r, ray, dist_r);
+			if (hit_l || hit_r) {
+				uint64_t bit = uint64_t(1) << level;
+				if (!(trail & bit)) {
+					if (hit_l && hit_r) {
+						id = node.link_l;
+						level++;
+						continue;
+					}
+					trail = (trail & (bit-1)) | bit;
+				}
+				id = hit_r ? node.link_r : node.link_l;
+				level++;
+				continue;
+			}
+		}
+		else {
+			if (any_hit_leaf(node.tri_offset(), node.tri_count(), ray, &blocker, mb))
+				return true;
+		}
+		uint64_t open = ~trail & ((uint64_t(1) << level) - 1);
+		if (!open)
+			break;
+		int j = 63 - __builtin_clzll(open);
+		trail = (trail & ((uint64_t(1) << j) - 1)) | (uint64_t(1) << j);
+		id = root;
+		level = 0;
+	}
+	return false;
+}
+
+/* Traversierung der quantisierten Knoten, wie oben, nur wird zu jedem Knoten auf dem Stack die (dekodierte) Box
+ * mitgeführt, relativ zu der die Boxen seiner Kinder gespeichert sind.
+ */
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+triangle_intersection binary_bvh_tracer<tr_layout, esc_mode, node_format>::closest_hit_quantized(const ray &ray, mailbox *mb) {
+	triangle_intersection closest;
+	traversal_stack<uint32_t> stack(levels);
+	traversal_stack<aabb> frame(levels);
+	int32_t sp = 0;
+	stack[0] = root;
+	frame[0] = qroot_box;
+	while (sp >= 0) {
+		const qnode &node = qnodes[stack[sp]];
+		aabb box = frame[sp--];
+		if (node.inner()) {
+			aabb box_l = dequantize(box, node.lo_l, node.hi_l);
+			aabb box_r = dequantize(box, node.lo_r, node.hi_r);
+			float dist_l, dist_r;
+			bool hit_l = intersect4(box_l, ray, dist_l) && dist_l < closest.t;
+			bool hit_r = intersect4(box_r, ray, dist_r) && dist_r < closest.t;
+			if (hit_l && hit_r)
+				if (dist_l < dist_r) {
+					stack[++sp] = node.link_r; frame[sp] = box_r;
+					stack[++sp] = node.link_l; frame[sp] = box_l;
+				}
+				else {
+					stack[++sp] = node.link_l; frame[sp] = box_l;
+					stack[++sp] = node.link_r; frame[sp] = box_r;
+				}
+			else if (hit_l) {
+				stack[++sp] = node.link_l; frame[sp] = box_l;
+			}
+			else if (hit_r) {
+				stack[++sp] = node.link_r; frame[sp] = box_r;
+			}
+		}
+		else {
+			intersect_leaf(node.tri_offset(), node.tri_count(), ray, closest, mb);
+		}
+	}
+	return closest;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::any_hit_quantized(const ray &ray, int32_t &blocker, mailbox *mb) {
+	traversal_stack<uint32_t> stack(levels);
+	traversal_stack<aabb> frame(levels);
+	int32_t sp = 0;
+	stack[0] = root;
+	frame[0] = qroot_box;
+	while (sp >= 0) {
+		const qnode &node = qnodes[stack[sp]];
+		aabb box = frame[sp--];
+		if (node.inner()) {
+			aabb box_l = dequantize(box, node.lo_l, node.hi_l);
+			aabb box_r = dequantize(box, node.lo_r, node.hi_r);
+			float dist_l, dist_r;
+			if (intersect4(box_l, ray, dist_l)) {
+				stack[++sp] = node.link_l; frame[sp] = box_l;
+			}
+			if (intersect4(box_r, ray, dist_r)) {
+				stack[++sp] = node.link_r; frame[sp] = box_r;
+			}
+		}
+		else {
+			if (any_hit_leaf(node.tri_offset(), node.tri_count(), ray, &blocker, mb))
+				return true;
+		}
+	}
+	return false;
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+bool binary_bvh_tracer<tr_layout, esc_mode, node_format>::interprete(const std::string &command, std::istringstream &in) {
 	std::string value;
 	if (command == "bvh") {
 		in >> value;
 		if (value == "om") {
 			binary_split_type = om;
+			build_settings_changed = true;
 			return true;
 		}
 		else if (value == "sm") {
 			binary_split_type = sm;
+			build_settings_changed = true;
 			return true;
 		}
 		else if (value == "sah") {
@@ -519,6 +2518,243 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &comma
 			in >> temp;
 			check_in_complete("Syntax error, \"bvh sah\" requires exactly one positive integral value");
 			number_of_planes = temp;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "binned-sah") {
+			int temp;
+			in >> temp;
+			check_in_complete("Syntax error, \"bvh binned-sah\" requires exactly one integral value >= 2");
+			if (temp < 2)
+				error("The number of bins has to be at least 2");
+			binary_split_type = binned_sah;
+			number_of_bins = temp;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "sah-full") {
+			if (!(in >> std::ws).eof()) {
+				int temp;
+				in >> value >> temp;
+				check_in_complete("Syntax error, \"bvh sah-full\" takes an optional \"exact N\"");
+				if (value != "exact" || temp < 0)
+					error("Syntax error, \"bvh sah-full\" takes an optional \"exact N\" with N >= 0");
+				exact_sweep_below = temp;
+			}
+			binary_split_type = sah_full;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "sbvh") {
+			if (tr_layout == bbvh_triangle_layout::flat)
+				error("The SBVH duplicates references and requires \"raytracer bbvh indexed\"");
+			if (!(in >> std::ws).eof()) {
+				float temp;
+				in >> temp;
+				check_in_complete("Syntax error, \"bvh sbvh\" takes an optional overlap threshold alpha");
+				if (temp < 0)
+					error("The overlap threshold has to be non-negative");
+				sbvh_alpha = temp;
+			}
+			binary_split_type = sbvh;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "refit-monitor") {
+			in >> value;
+			if (value == "off") {
+				check_in_complete("Syntax error, \"bvh refit-monitor\" requires off or a factor > 1");
+				refit_rebuild_factor = 0;
+				return true;
+			}
+			float temp;
+			std::istringstream factor(value);
+			factor >> temp;
+			check_in_complete("Syntax error, \"bvh refit-monitor\" requires off or a factor > 1");
+			if (factor.fail() || temp <= 1)
+				error("The factor has to be larger than 1");
+			refit_rebuild_factor = temp;
+			return true;
+		}
+		else if (value == "optimize") {
+			int temp;
+			in >> temp;
+			check_in_complete("Syntax error, \"bvh optimize\" requires the number of treelet restructuring passes (0: off)");
+			if (temp < 0)
+				error("The number of passes has to be non-negative");
+			optimization_passes = temp;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "cache") {
+			in >> value;
+			check_in_complete("Syntax error, \"bvh cache\" requires a directory or off");
+			if (value == "off")
+				cache_dir = "";
+			else {
+				struct stat st;
+				if (stat(value.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+					error("There is no directory " << value);
+				cache_dir = value;
+			}
+			return true;
+		}
+		else if (value == "layout") {
+			in >> value;
+			if (value == "dfs") node_layout = dfs;
+			else if (value == "veb") node_layout = veb;
+			else if (value == "bfs") {
+				node_layout = bfs_treelets;
+				if (!(in >> std::ws).eof()) {
+					int temp;
+					in >> temp;
+					if (in.fail() || temp < 1)
+						error("The treelet size has to be a positive integral value");
+					treelet_size = temp;
+				}
+			}
+			else if (value == "colocate") {
+				in >> value;
+				if (value != "on" && value != "off")
+					error("Syntax error, \"bvh layout colocate\" requires on or off");
+				colocate_triangles = value == "on";
+			}
+			else if (value == "bench") {
+				int rays = 1000000;
+				if (!(in >> std::ws).eof())
+					in >> rays;
+				check_in_complete("Syntax error, \"bvh layout bench\" takes an optional number of rays");
+				if (rays <= 0)
+					error("The number of rays has to be positive");
+				if (nodes.empty())
+					error("There is no BVH to benchmark (use commit)");
+				layout_benchmark(rays);
+				return true;
+			}
+			else error("Syntax error, \"bvh layout\" requires dfs, bfs [treelet size], veb, colocate on|off or bench [rays]");
+			check_in_complete("Syntax error, trailing arguments to \"bvh layout\"");
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "traversal") {
+			in >> value;
+			check_in_complete("Syntax error, \"bvh traversal\" requires stack or restart-trail");
+			if (value == "stack") traversal_mode = with_stack;
+			else if (value == "restart-trail") traversal_mode = restart_trail;
+			else error("Syntax error, \"bvh traversal\" requires stack or restart-trail");
+			return true;
+		}
+		else if (value == "occlusion") {
+			in >> value;
+			if (value == "order") {
+				in >> value;
+				check_in_complete("Syntax error, \"bvh occlusion order\" requires distance, axis or none");
+				if (value == "distance") occlusion_order = by_distance;
+				else if (value == "axis") occlusion_order = by_axis;
+				else if (value == "none") occlusion_order = unordered;
+				else error("Syntax error, \"bvh occlusion order\" requires distance, axis or none");
+			}
+			else if (value == "cache") {
+				in >> value;
+				check_in_complete("Syntax error, \"bvh occlusion cache\" requires on or off");
+				if (value != "on" && value != "off")
+					error("Syntax error, \"bvh occlusion cache\" requires on or off");
+				use_occluder_cache = value == "on";
+			}
+			else error("Syntax error, \"bvh occlusion\" requires order distance|axis|none or cache on|off");
+			return true;
+		}
+		else if (value == "kernel") {
+			if (node_format != bbvh_node_format::full)
+				error("The intersection kernels can only be selected for full (unquantized) nodes");
+			bool any = false;
+			while (in >> value) {
+				any = true;
+				if (value == "bench") {
+					int rays = 100000;
+					if (!(in >> std::ws).eof())
+						in >> rays;
+					check_in_complete("Syntax error, \"bvh kernel bench\" takes an optional number of rays");
+					if (rays <= 0)
+						error("The number of rays has to be positive");
+					if (nodes.empty())
+						error("There is no BVH to benchmark (use commit)");
+					kernel_benchmark(rays);
+					return true;
+				}
+				auto box = std::find(std::begin(box_kernel_names), std::end(box_kernel_names), value);
+				auto tri = std::find(std::begin(tri_kernel_names), std::end(tri_kernel_names), value);
+				if (box != std::end(box_kernel_names))
+					box_kernel = (enum box_kernel)(box - std::begin(box_kernel_names));
+				else if (tri != std::end(tri_kernel_names))
+					tri_kernel = (enum tri_kernel)(tri - std::begin(tri_kernel_names));
+				else
+					error("There is no intersection kernel called '" << value << "', box tests are branchy, divide, reciprocal, "
+					      "precomputed and simd, triangle tests shirley, moeller, baldwin and woop");
+			}
+			if (!any)
+				error("Syntax error, \"bvh kernel\" requires box and/or triangle test names or bench [rays]");
+			select_kernel();
+			if (scene && !nodes.empty())
+				build_triangle_records();
+			return true;
+		}
+		else if (value == "mailbox") {
+			in >> value;
+			check_in_complete("Syntax error, \"bvh mailbox\" requires on or off");
+			if (value != "on" && value != "off")
+				error("Syntax error, \"bvh mailbox\" requires on or off");
+			use_mailbox = value == "on";
+			return true;
+		}
+		else if (value == "packets") {
+			in >> value;
+			check_in_complete("Syntax error, \"bvh packets\" requires on or off");
+			if (value != "on" && value != "off")
+				error("Syntax error, \"bvh packets\" requires on or off");
+			packet_traversal = value == "on";
+			return true;
+		}
+		else if (value == "sah-costs") {
+			float k_t, k_i;
+			in >> k_t >> k_i;
+			check_in_complete("Syntax error, \"bvh sah-costs\" requires the traversal and the intersection cost");
+			if (k_t < 0 || k_i <= 0)
+				error("The traversal cost has to be non-negative, the intersection cost positive");
+			cost_traversal = k_t;
+			cost_intersect = k_i;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "lbvh") {
+			int temp = 30;
+			if (!(in >> std::ws).eof()) {
+				in >> temp;
+				check_in_complete("Syntax error, \"bvh lbvh\" takes an optional number of Morton code bits (30 or 63)");
+			}
+			if (temp != 30 && temp != 63)
+				error("The Morton code has to have 30 or 63 bits");
+			binary_split_type = lbvh;
+			morton_bits = temp;
+			build_settings_changed = true;
+			return true;
+		}
+		else if (value == "parallel") {
+			in >> value;
+			if (value == "on" || value == "off") {
+				check_in_complete("Syntax error, \"bvh parallel\" requires on, off or cutoff N");
+				parallel_build = value == "on";
+			}
+			else if (value == "cutoff") {
+				int temp;
+				in >> temp;
+				check_in_complete("Syntax error, \"bvh parallel cutoff\" requires exactly one positive integral value");
+				if (temp <= 0)
+					error("The cutoff has to be positive");
+				parallel_cutoff = temp;
+			}
+			else error("Syntax error, \"bvh parallel\" requires on, off or cutoff N");
+			build_settings_changed = true;
 			return true;
 		}
 		else if (value == "triangles") {
@@ -530,7 +2766,22 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &comma
 				max_triangles_per_node = temp;
 			}
 			else if (value == "single") max_triangles_per_node = 1;
-			else error("Syntax error, \"bvh triangles\" requires a mode (single or multiple)");
+			else if (value == "records") {
+				in >> value;
+				check_in_complete("Syntax error, \"triangles records\" requires on or off");
+				if (value != "on" && value != "off")
+					error("Syntax error, \"triangles records\" requires on or off");
+				use_triangle_records = value == "on";
+			}
+			else if (value == "blocks") {
+				in >> value;
+				check_in_complete("Syntax error, \"triangles blocks\" requires 4, 8 or off");
+				if (value != "4" && value != "8" && value != "off")
+					error("Syntax error, \"triangles blocks\" requires 4, 8 or off");
+				triangle_block_width = value == "off" ? 0 : std::stoi(value);
+			}
+			else error("Syntax error, \"bvh triangles\" requires a mode (single, multiple, records or blocks)");
+			build_settings_changed = true;
 			return true;
 		}
 		else if (value == "statistics") {
@@ -554,8 +2805,8 @@ bool binary_bvh_tracer<tr_layout, esc_mode>::interprete(const std::string &comma
 	return false;
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-void binary_bvh_tracer<tr_layout, esc_mode>::export_bvh(uint32_t node_id, uint32_t *id, uint32_t depth, std::string *filename) {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::export_bvh(uint32_t node_id, uint32_t *id, uint32_t depth, std::string *filename) {
 	using namespace std;
 	auto export_aabb = [&](const aabb box, const uint32_t vert[]) {
 		ofstream out(*filename, ios::app);
@@ -596,8 +2847,8 @@ void binary_bvh_tracer<tr_layout, esc_mode>::export_bvh(uint32_t node_id, uint32
 	}
 }
 
-template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
-void binary_bvh_tracer<tr_layout, esc_mode>::print_node_stats() {
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode, bbvh_node_format node_format>
+void binary_bvh_tracer<tr_layout, esc_mode, node_format>::print_node_stats() {
 	std::vector<int> leaf_nodes;
 	uint32_t total_triangles = 0;
 	uint32_t number_of_leafs = 0;
@@ -626,6 +2877,38 @@ void binary_bvh_tracer<tr_layout, esc_mode>::print_node_stats() {
 	std::cout << "maximum triangles per node: " << max << std::endl;
 	std::cout << "average triangles per node: " << (total_triangles/number_of_leafs) << std::endl;
 	std::cout << "median of triangles per node: " << median << std::endl;
+	std::cout << "build time: " << build_time_ms << "ms" << std::endl;
+	std::cout << "SAH cost: " << sah_cost() << std::endl;
+	std::cout << "levels: " << levels << (traversal_mode == restart_trail && levels > 64 ? " (too deep for restart-trail, using a stack)" : "") << std::endl;
+	if (node_format == bbvh_node_format::full)
+		std::cout << "node size: " << sizeof(node) << " bytes" << std::endl;
+	else
+		std::cout << "node size: " << sizeof(qnode) << " bytes (quantized, " << sizeof(node) << " unquantized)" << std::endl;
+	std::cout << "acceleration structure: " << traversal_bytes() << " bytes" << std::endl;
+	if (node_format != bbvh_node_format::full)
+		std::cout << "unquantized nodes kept for refit/statistics: " << nodes.size() * sizeof(node) << " bytes" << std::endl;
+	if (optimization_passes > 0)
+		std::cout << "SAH cost before treelet optimization: " << sah_cost_before_optimization << std::endl;
+	uint64_t occluder_tests = 0, occluder_hits = 0, mailbox_skipped = 0;
+	for (const thread_slot &slot : thread_slots) {
+		occluder_tests += slot.occluder_tests;
+		occluder_hits += slot.occluder_hits;
+		mailbox_skipped += slot.mailbox_skipped;
+	}
+	if (occluder_tests)
+		std::cout << "occluder cache: " << occluder_hits << " of " << occluder_tests << " shadow rays blocked by the last occluder" << std::endl;
+	if (node_format == bbvh_node_format::full)
+		std::cout << "kernel: " << box_kernel_names[box_kernel] << " box test, " << tri_kernel_names[tri_kernel] << " triangle test"
+		          << (traversal_mode == restart_trail ? " (only used by the stack traversal)" : "") << std::endl;
+	if (duplicate_references)
+		std::cout << "triangle references: " << index.size() << " for " << triangles_in_bvh() << " triangles, mailbox "
+		          << (mailboxing() ? "on, " + std::to_string(mailbox_skipped) + " repeated tests skipped" : "off") << std::endl;
+	if (size_t blocks = blocks4.size() + blocks8.size())
+		std::cout << "triangle blocks: " << blocks << " of " << triangle_block_width << " ("
+		          << (triangle_block_width == 8 ? lanes<8>::name : lanes<4>::name) << "), "
+		          << (100.0f * total_triangles / (blocks * triangle_block_width)) << "% of the lanes used" << std::endl;
+	if (node_format == bbvh_node_format::full && packet_traversal)
+		std::cout << "packet traversal: 8 rays at a time as " << lanes<8>::name << std::endl;
 		
 }
 
@@ -633,4 +2916,10 @@ void binary_bvh_tracer<tr_layout, esc_mode>::print_node_stats() {
 template class binary_bvh_tracer<bbvh_triangle_layout::flat,    bbvh_esc_mode::off>;
 template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
 template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
+template class binary_bvh_tracer<bbvh_triangle_layout::flat,    bbvh_esc_mode::off, bbvh_node_format::quantized16>;
+template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off, bbvh_node_format::quantized16>;
+template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on,  bbvh_node_format::quantized16>;
+template class binary_bvh_tracer<bbvh_triangle_layout::flat,    bbvh_esc_mode::off, bbvh_node_format::quantized8>;
+template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off, bbvh_node_format::quantized8>;
+template class binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::on,  bbvh_node_format::quantized8>;
 
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "libgi/intersect.h"
+#include "simd.h"
+
+/* Intersection kernels the stack traversal of binary_bvh_tracer is instantiated with (see bvh kernel).
+ *
+ * A box kernel provides test(box, ray, t_near), a triangle kernel test(bvh, i, ray, info) for the triangle at leaf
+ * position i.
+ */
+
+// Slab test with one SSE lane per axis and no branches. ray.o and ray.id are followed by further floats in ray, the
+// fourth lane is never looked at.
+inline bool intersect_slab_simd(const aabb &box, const ray &ray, float &is) {
+	__m128 o = _mm_loadu_ps(&ray.o.x);
+	__m128 id = _mm_loadu_ps(&ray.id.x);
+	__m128 lo = _mm_loadu_ps(&box.min.x);                                  // min.x min.y min.z max.x
+	__m128 hi = _mm_loadu_ps(&box.min.z);                                  // min.z max.x max.y max.z
+	hi = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(3, 3, 2, 1));
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(lo, o), id);
+	__m128 t2 = _mm_mul_ps(_mm_sub_ps(hi, o), id);
+	__m128 t_near = _mm_min_ps(t1, t2), t_far = _mm_max_ps(t1, t2);
+	t_near = _mm_max_ss(_mm_max_ss(t_near, _mm_shuffle_ps(t_near, t_near, 1)), _mm_movehl_ps(t_near, t_near));
+	t_far  = _mm_min_ss(_mm_min_ss(t_far, _mm_shuffle_ps(t_far, t_far, 1)), _mm_movehl_ps(t_far, t_far));
+	is = _mm_cvtss_f32(t_near);
+	return _mm_movemask_ps(_mm_cmple_ss(_mm_max_ss(t_near, _mm_set_ss(ray.t_min)), _mm_min_ss(t_far, _mm_set_ss(ray.t_max)))) & 1;
+}
+
+struct branchy_box_test {
+	static bool test(const aabb &box, const ray &ray, float &is) { return intersect(box, ray, is); }
+};
+struct divide_box_test {
+	static bool test(const aabb &box, const ray &ray, float &is) { return intersect2(box, ray, is); }
+};
+struct reciprocal_box_test {
+	static bool test(const aabb &box, const ray &ray, float &is) { return intersect3(box, ray, is); }
+};
+struct precomputed_box_test {
+	static bool test(const aabb &box, const ray &ray, float &is) { return intersect4(box, ray, is); }
+};
+struct simd_box_test {
+	static bool test(const aabb &box, const ray &ray, float &is) { return intersect_slab_simd(box, ray, is); }
+};
+
+//! Shirley's test on the scene's triangles, or Möller-Trumbore on the triangle records if they are built
+struct shirley_tri_test {
+	template<typename BVH> static bool test(BVH &bvh, int i, const ray &ray, triangle_intersection &is) {
+		return bvh.intersect_leaf_triangle(i, ray, is);
+	}
+};
+struct moeller_tri_test {
+	template<typename BVH> static bool test(BVH &bvh, int i, const ray &ray, triangle_intersection &is) {
+		if (!bvh.records.empty())
+			return intersect(bvh.records[i], ray, is);
+		vec3 a, b, c;
+		bvh.leaf_triangle(i, a, b, c);
+		return intersect(triangle_record(a, b, c), ray, is);
+	}
+};
+//! Needs the transformations in binary_bvh_tracer::bw_records, which are only built while this kernel is selected
+struct baldwin_tri_test {
+	template<typename BVH> static bool test(BVH &bvh, int i, const ray &ray, triangle_intersection &is) {
+		return intersect(bvh.bw_records[i], ray, is);
+	}
+};
+struct woop_tri_test {
+	template<typename BVH> static bool test(BVH &bvh, int i, const ray &ray, triangle_intersection &is) {
+		vec3 a, b, c;
+		bvh.leaf_triangle(i, a, b, c);
+		return intersect_watertight(a, b, c, ray, is);
+	}
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "libgi/rt.h"
+
+#include <immintrin.h>
+
+/* SIMD helpers, W lanes of float (SSE for 4, AVX for 8 if the compiler targets it, see configure --enable-avx).
+ *
+ * Comparisons return the movemask of the lanes for which they hold, they are ordered, i.e. false for NaN lanes.
+ * \c name says how the lanes are actually processed, for the statistics.
+ */
+template<int W> struct lanes;
+
+template<> struct lanes<4> {
+	typedef __m128 f;
+	static constexpr const char *name = "SSE";
+	static f load(const float *p) { return _mm_load_ps(p); }
+	static f set1(float x) { return _mm_set1_ps(x); }
+	static f min(f a, f b) { return _mm_min_ps(a, b); }
+	static f max(f a, f b) { return _mm_max_ps(a, b); }
+	static f add(f a, f b) { return _mm_add_ps(a, b); }
+	static f sub(f a, f b) { return _mm_sub_ps(a, b); }
+	static f mul(f a, f b) { return _mm_mul_ps(a, b); }
+	static f div(f a, f b) { return _mm_div_ps(a, b); }
+	static int lt(f a, f b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+	static int le(f a, f b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+	static void store(float *p, f a) { _mm_store_ps(p, a); }
+};
+
+#ifdef __AVX__
+template<> struct lanes<8> {
+	typedef __m256 f;
+	static constexpr const char *name = "AVX";
+	static f load(const float *p) { return _mm256_load_ps(p); }
+	static f set1(float x) { return _mm256_set1_ps(x); }
+	static f min(f a, f b) { return _mm256_min_ps(a, b); }
+	static f max(f a, f b) { return _mm256_max_ps(a, b); }
+	static f add(f a, f b) { return _mm256_add_ps(a, b); }
+	static f sub(f a, f b) { return _mm256_sub_ps(a, b); }
+	static f mul(f a, f b) { return _mm256_mul_ps(a, b); }
+	static f div(f a, f b) { return _mm256_div_ps(a, b); }
+	static int lt(f a, f b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+	static int le(f a, f b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+	static void store(float *p, f a) { _mm256_store_ps(p, a); }
+};
+#else
+// Without AVX the 8 lanes are processed as two SSE halves
+template<> struct lanes<8> {
+	struct f { __m128 lo, hi; };
+	typedef lanes<4> h;
+	static constexpr const char *name = "two SSE halves";
+	static f load(const float *p) { return { h::load(p), h::load(p+4) }; }
+	static f set1(float x) { return { h::set1(x), h::set1(x) }; }
+	static f min(f a, f b) { return { h::min(a.lo, b.lo), h::min(a.hi, b.hi) }; }
+	static f max(f a, f b) { return { h::max(a.lo, b.lo), h::max(a.hi, b.hi) }; }
+	static f add(f a, f b) { return { h::add(a.lo, b.lo), h::add(a.hi, b.hi) }; }
+	static f sub(f a, f b) { return { h::sub(a.lo, b.lo), h::sub(a.hi, b.hi) }; }
+	static f mul(f a, f b) { return { h::mul(a.lo, b.lo), h::mul(a.hi, b.hi) }; }
+	static f div(f a, f b) { return { h::div(a.lo, b.lo), h::div(a.hi, b.hi) }; }
+	static int lt(f a, f b) { return h::lt(a.lo, b.lo) | (h::lt(a.hi, b.hi) << 4); }
+	static int le(f a, f b) { return h::le(a.lo, b.lo) | (h::le(a.hi, b.hi) << 4); }
+	static void store(float *p, f a) { h::store(p, a.lo); h::store(p+4, a.hi); }
+};
+#endif
+
+/* W triangles in SoA layout: the first vertex and both edges, one lane per triangle. Unused lanes are all zero, their
+ * determinant is zero and they never report a hit.
+ */
+template<int W> struct alignas(32) triangle_block {
+	float ax[W], ay[W], az[W];
+	float e1x[W], e1y[W], e1z[W];
+	float e2x[W], e2y[W], e2z[W];
+
+	void set(int lane, const vec3 &a, const vec3 &b, const vec3 &c) {
+		ax[lane] = a.x;        ay[lane] = a.y;        az[lane] = a.z;
+		e1x[lane] = b.x - a.x; e1y[lane] = b.y - a.y; e1z[lane] = b.z - a.z;
+		e2x[lane] = c.x - a.x; e2y[lane] = c.y - a.y; e2z[lane] = c.z - a.z;
+	}
+};
+
+/* Möller-Trumbore for all W triangles of a block at once, same conventions as intersect(triangle_record...).
+ * Returns the bit mask of the lanes hit within (t_min,t_max) and stores their distances and barycentric coordinates.
+ */
+template<int W>
+inline int intersect(const triangle_block<W> &b, const ray &ray, float t_max, float *t, float *beta, float *gamma) {
+	typedef lanes<W> L;
+	typedef typename L::f f;
+	f dx = L::set1(ray.d.x), dy = L::set1(ray.d.y), dz = L::set1(ray.d.z);
+	f e1x = L::load(b.e1x), e1y = L::load(b.e1y), e1z = L::load(b.e1z);
+	f e2x = L::load(b.e2x), e2y = L::load(b.e2y), e2z = L::load(b.e2z);
+	f px = L::sub(L::mul(dy, e2z), L::mul(dz, e2y));
+	f py = L::sub(L::mul(dz, e2x), L::mul(dx, e2z));
+	f pz = L::sub(L::mul(dx, e2y), L::mul(dy, e2x));
+	f det = L::add(L::add(L::mul(e1x, px), L::mul(e1y, py)), L::mul(e1z, pz));
+	f inv = L::div(L::set1(1.0f), det);
+	f sx = L::sub(L::set1(ray.o.x), L::load(b.ax));
+	f sy = L::sub(L::set1(ray.o.y), L::load(b.ay));
+	f sz = L::sub(L::set1(ray.o.z), L::load(b.az));
+	f u = L::mul(L::add(L::add(L::mul(sx, px), L::mul(sy, py)), L::mul(sz, pz)), inv);
+	f qx = L::sub(L::mul(sy, e1z), L::mul(sz, e1y));
+	f qy = L::sub(L::mul(sz, e1x), L::mul(sx, e1z));
+	f qz = L::sub(L::mul(sx, e1y), L::mul(sy, e1x));
+	f v = L::mul(L::add(L::add(L::mul(dx, qx), L::mul(dy, qy)), L::mul(dz, qz)), inv);
+	f d = L::mul(L::add(L::add(L::mul(e2x, qx), L::mul(e2y, qy)), L::mul(e2z, qz)), inv);
+	f zero = L::set1(0.0f);
+	int mask = L::lt(zero, u) & L::lt(zero, v) & L::le(L::add(u, v), L::set1(1.0f))
+	         & L::lt(L::set1(ray.t_min), d) & L::lt(d, L::set1(t_max));
+	L::store(t, d);
+	L::store(beta, u);
+	L::store(gamma, v);
+	return mask;
+}
@@ -0,0 +1,332 @@
+#include "tlbvh.h"
+
+#include "libgi/timer.h"
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+#define error(x) { std::cerr << "command " << command << ": " << x << std::endl; return true;}
+using namespace glm;
+
+namespace {
+	float surface(const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return 2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z);
+	}
+
+	aabb transform(const aabb &box, const mat4 &trafo) {
+		aabb res;
+		for (int i = 0; i < 8; ++i) {
+			vec3 corner((i&1) ? box.max.x : box.min.x, (i&2) ? box.max.y : box.min.y, (i&4) ? box.max.z : box.min.z);
+			res.grow(vec3(trafo * vec4(corner, 1.0f)));
+		}
+		return res;
+	}
+}
+
+two_level_bvh_tracer::~two_level_bvh_tracer() {
+	for (auto *b : bottom)
+		delete b;
+}
+
+void two_level_bvh_tracer::build(::scene *scene) {
+	time_this_block(build_two_level_bvh);
+	this->scene = scene;
+	std::cout << "Building two-level BVH..." << std::endl;
+	auto t1 = std::chrono::high_resolution_clock::now();
+	restore_load_order();
+
+	if (build_bottom_levels() == 0)
+		std::cout << "Objects did not change, rebuilding the top level only" << std::endl;
+	auto t2 = std::chrono::high_resolution_clock::now();
+	build_top_level();
+
+	auto t3 = std::chrono::high_resolution_clock::now();
+	top_level_ms = std::chrono::duration<float, std::milli>(t3 - t2).count();
+	std::cout << "Done after " << std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t1).count() << "ms"
+	          << " (top level: " << top_level_ms << "ms)" << std::endl;
+}
+
+bool two_level_bvh_tracer::bottom_level_current(unsigned object) const {
+	if (settings_changed || object >= bottom.size())
+		return false;
+	const scene::object &obj = scene->objects[object];
+	const bottom_level *b = bottom[object];
+	return b->first_triangle == obj.start && b->triangle_count == obj.end - obj.start;
+}
+
+/* Ein flaches bbvh sortiert die Dreiecke der Szene um, dann beschreiben die Objekte nicht mehr, welche Dreiecke zu
+ * ihnen gehören. Die ursprüngliche Reihenfolge wird wiederhergestellt, die vorhandenen unteren Ebenen referenzieren
+ * ohnehin die Reihenfolge beim Laden und bleiben so gültig.
+ */
+void two_level_bvh_tracer::restore_load_order() {
+	if (scene->loaded_at.empty())
+		return;
+	std::cout << "Restoring the triangle order the scene was loaded in" << std::endl;
+	scene->restore_triangle_order();
+}
+
+aabb two_level_bvh_tracer::triangle_bounds(const bottom_level &b) const {
+	aabb box;
+	for (unsigned i = b.first_triangle; i < b.first_triangle + b.triangle_count; ++i) {
+		const triangle &tri = scene->triangles[i];
+		box.grow(scene->vertices[tri.a].pos);
+		box.grow(scene->vertices[tri.b].pos);
+		box.grow(scene->vertices[tri.c].pos);
+	}
+	return box;
+}
+
+/* Jedes Objekt bekommt einen binary_bvh_tracer mit den eingestellten Parametern, der nur über die Dreiecke des Objekts
+ * in der Szene gebaut wird (first_triangle/triangle_count). Da das Layout indiziert ist, bleiben die Dreiecke, wo sie
+ * sind, und Treffer beziehen sich direkt auf die Dreiecke der Szene.
+ * Gebaut wird nur für Objekte, die noch keine (passende) untere Ebene haben, gibt die Anzahl dieser zurück.
+ */
+unsigned two_level_bvh_tracer::build_bottom_levels() {
+	auto t1 = std::chrono::high_resolution_clock::now();
+	for (unsigned o = scene->objects.size(); o < bottom.size(); ++o)
+		delete bottom[o];
+	bottom.resize(std::min(bottom.size(), scene->objects.size()));
+	unsigned built = 0;
+	for (unsigned o = 0; o < scene->objects.size(); ++o) {
+		if (bottom_level_current(o))
+			continue;
+		const scene::object &obj = scene->objects[o];
+		bottom_level *b = new bottom_level;
+		if (o < bottom.size()) {
+			delete bottom[o];
+			bottom[o] = b;
+		}
+		else
+			bottom.push_back(b);
+		built++;
+		b->first_triangle = obj.start;
+		b->triangle_count = obj.end - obj.start;
+		if (b->triangle_count == 0)
+			continue;
+		b->box = triangle_bounds(*b);
+		b->bvh = config;
+		b->bvh.verbose = false;
+		b->bvh.first_triangle = b->first_triangle;
+		b->bvh.triangle_count = b->triangle_count;
+		b->bvh.build(scene);
+	}
+	settings_changed = false;
+	auto t2 = std::chrono::high_resolution_clock::now();
+	if (built > 0) {
+		bottom_level_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+		std::cout << built << " of " << bottom.size() << " bottom levels built after " << bottom_level_ms << "ms" << std::endl;
+	}
+	return built;
+}
+
+void two_level_bvh_tracer::build_top_level() {
+	placements.clear();
+	for (unsigned i = 0; i < bottom.size(); ++i)
+		if (bottom[i]->triangle_count > 0)
+			placements.push_back({ i, triangle_intersection::no_instance, mat4(1.0f), bottom[i]->box });
+	for (unsigned i = 0; i < scene->instances.size(); ++i) {
+		const scene::instance &inst = scene->instances[i];
+		if (bottom[inst.object]->triangle_count > 0)
+			placements.push_back({ inst.object, i, inverse(inst.trafo), transform(bottom[inst.object]->box, inst.trafo) });
+	}
+	nodes.clear();
+	if (placements.empty())
+		return;
+	nodes.reserve(2*placements.size()-1);
+	root = subdivide(0, placements.size());
+	levels = tree_levels(root, [&](uint32_t i) { return nodes[i].inner(); },
+	                     [&](uint32_t i) { return nodes[i].link_l; }, [&](uint32_t i) { return nodes[i].link_r; });
+}
+
+/* Die obere Ebene ist klein (eine Platzierung pro Blatt), daher wird hier für jede Achse sortiert und die SAH an allen
+ * Positionen ausgewertet.
+ */
+uint32_t two_level_bvh_tracer::subdivide(uint32_t start, uint32_t end) {
+	uint32_t id = nodes.size();
+	nodes.emplace_back();
+	if (end - start == 1) {
+		nodes[id].link_l = -(int32_t)start;
+		nodes[id].link_r = -1;
+		return id;
+	}
+	auto sort_along = [&](int axis) {
+		std::sort(placements.begin()+start, placements.begin()+end, [axis](const placement &a, const placement &b) {
+			return a.box.min[axis]+a.box.max[axis] < b.box.min[axis]+b.box.max[axis];
+		});
+	};
+	std::vector<float> right_surface(end - start);
+	int best_axis = 0;
+	uint32_t best_split = start + (end - start) / 2;
+	float best_cost = FLT_MAX;
+	for (int axis = 0; axis < 3; ++axis) {
+		sort_along(axis);
+		aabb box;
+		for (uint32_t i = end-1; i > start; --i) {
+			box.grow(placements[i].box);
+			right_surface[i-start] = surface(box);
+		}
+		box = aabb();
+		for (uint32_t i = start; i < end-1; ++i) {
+			box.grow(placements[i].box);
+			float cost = surface(box) * (i-start+1) + right_surface[i+1-start] * (end-i-1);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i+1;
+			}
+		}
+	}
+	if (best_axis != 2)
+		sort_along(best_axis);
+
+	aabb box_l, box_r;
+	for (uint32_t i = start; i < best_split; ++i) box_l.grow(placements[i].box);
+	for (uint32_t i = best_split; i < end; ++i)   box_r.grow(placements[i].box);
+	uint32_t l = subdivide(start, best_split);
+	uint32_t r = subdivide(best_split, end);
+	nodes[id].box_l = box_l;
+	nodes[id].box_r = box_r;
+	nodes[id].link_l = l;
+	nodes[id].link_r = r;
+	return id;
+}
+
+void two_level_bvh_tracer::refit() {
+	time_this_block(refit_two_level_bvh);
+	std::cout << "Refitting two-level BVH..." << std::endl;
+	auto t1 = std::chrono::high_resolution_clock::now();
+	restore_load_order();
+	std::vector<bool> fresh(scene->objects.size());
+	for (unsigned o = 0; o < fresh.size(); ++o)
+		fresh[o] = !bottom_level_current(o);
+	build_bottom_levels();
+	for (unsigned o = 0; o < bottom.size(); ++o) {
+		bottom_level *b = bottom[o];
+		if (fresh[o] || b->triangle_count == 0)
+			continue;
+		b->box = triangle_bounds(*b);
+		b->bvh.refit();
+	}
+	build_top_level();
+	auto t2 = std::chrono::high_resolution_clock::now();
+	std::cout << "Done after " << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << "ms" << std::endl;
+}
+
+::ray two_level_bvh_tracer::to_object(const ::ray &ray, const placement &p) const {
+	// Die Richtung wird nicht normiert, so bleibt t in beiden Räumen dasselbe
+	::ray r(vec3(p.to_object * vec4(ray.o, 1.0f)), vec3(p.to_object * vec4(ray.d, 0.0f)));
+	r.t_min = ray.t_min;
+	r.t_max = ray.t_max;
+	return r;
+}
+
+triangle_intersection two_level_bvh_tracer::closest_hit(const ray &ray) {
+	time_this_block(two_level_closest_hit);
+	triangle_intersection closest;
+	if (nodes.empty())
+		return closest;
+	traversal_stack<uint32_t> stack(levels);
+	int32_t sp = 0;
+	stack[0] = root;
+	while (sp >= 0) {
+		const node &node = nodes[stack[sp--]];
+		if (node.inner()) {
+			float dist_l, dist_r;
+			bool hit_l = intersect4(node.box_l, ray, dist_l) && dist_l < closest.t;
+			bool hit_r = intersect4(node.box_r, ray, dist_r) && dist_r < closest.t;
+			if (hit_l && hit_r)
+				if (dist_l < dist_r) {
+					stack[++sp] = node.link_r;
+					stack[++sp] = node.link_l;
+				}
+				else {
+					stack[++sp] = node.link_l;
+					stack[++sp] = node.link_r;
+				}
+			else if (hit_l)
+				stack[++sp] = node.link_l;
+			else if (hit_r)
+				stack[++sp] = node.link_r;
+		}
+		else {
+			for (int i = 0; i < node.count(); ++i) {
+				const placement &p = placements[node.first()+i];
+				::ray r = p.instance == triangle_intersection::no_instance ? ray : to_object(ray, p);
+				r.t_max = std::min(r.t_max, closest.t);
+				triangle_intersection is = bottom[p.object]->bvh.closest_hit_untimed(r);
+				if (is.valid() && is.t < closest.t) {
+					closest = is;
+					closest.instance = p.instance;
+				}
+			}
+		}
+	}
+	return closest;
+}
+
+bool two_level_bvh_tracer::any_hit(const ray &ray) {
+	time_this_block(two_level_any_hit);
+	if (nodes.empty())
+		return false;
+	traversal_stack<uint32_t> stack(levels);
+	int32_t sp = 0;
+	stack[0] = root;
+	while (sp >= 0) {
+		const node &node = nodes[stack[sp--]];
+		if (node.inner()) {
+			float dist;
+			if (intersect4(node.box_l, ray, dist)) stack[++sp] = node.link_l;
+			if (intersect4(node.box_r, ray, dist)) stack[++sp] = node.link_r;
+		}
+		else {
+			for (int i = 0; i < node.count(); ++i) {
+				const placement &p = placements[node.first()+i];
+				if (bottom[p.object]->bvh.any_hit_untimed(p.instance == triangle_intersection::no_instance ? ray : to_object(ray, p)))
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool two_level_bvh_tracer::interprete(const std::string &command, std::istringstream &in) {
+	if (command != "bvh")
+		return false;
+	std::streampos pos = in.tellg();
+	std::string value;
+	in >> value;
+	if (value == "statistics") {
+		size_t unique = 0, placed = 0, bytes = 0;
+		for (auto *b : bottom) {
+			unique += b->triangle_count;
+			bytes += b->bvh.nodes.size() * sizeof(bottom_level_tracer::node) + b->bvh.index.size() * sizeof(uint32_t);
+		}
+		for (auto &p : placements)
+			placed += bottom[p.object]->triangle_count;
+		std::cout << "objects: " << bottom.size() << std::endl;
+		std::cout << "instances: " << (scene ? scene->instances.size() : 0) << std::endl;
+		std::cout << "placements: " << placements.size() << std::endl;
+		std::cout << "triangles stored: " << unique << ", placed: " << placed << std::endl;
+		std::cout << "top level nodes: " << nodes.size() << ", levels: " << levels << std::endl;
+		std::cout << "acceleration structure: " << bytes << " bytes bottom level, "
+		          << nodes.size() * sizeof(node) + placements.size() * sizeof(placement) << " bytes top level" << std::endl;
+		std::cout << "build time: " << bottom_level_ms << "ms bottom level, " << top_level_ms << "ms top level" << std::endl;
+		return true;
+	}
+	if (value == "export")
+		error("The two-level BVH cannot be exported");
+	if (value == "layout") {
+		in >> value;
+		if (value == "bench")
+			error("The layout benchmark is only available for the binary BVH");
+	}
+	in.clear();
+	in.seekg(pos);
+	bool accepted = config.interprete(command, in);
+	if (config.build_settings_changed)
+		settings_changed = build_settings_changed = true;
+	config.build_settings_changed = false;
+	return accepted;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "bvh.h"
+
+#include "libgi/scene.h"
+
+/* Two-level BVH: every scene object gets its own (bottom level) binary_bvh_tracer, the top level is a BVH over all
+ * placements of the objects, i.e. each object where it was loaded plus all of scene::instances.
+ *
+ * The geometry of an object is held (and its BVH built) once, no matter how often it is placed; an instance only
+ * costs its transformation. The bottom levels reference the scene's triangles, which have to be in the order they
+ * were loaded in (a flat bbvh reorders them, this is undone on build). Builds are incremental: bottom levels are only built for objects that were added since
+ * the last build (scene::add only appends), the existing ones are merged with them by rebuilding the top level. The
+ * bvh commands configure the bottom level builds (and cause all of them to be rebuilt on the next commit).
+ */
+struct two_level_bvh_tracer : public ray_tracer {
+	typedef binary_bvh_tracer<bbvh_triangle_layout::indexed, bbvh_esc_mode::off> bottom_level_tracer;
+	struct bottom_level {
+		bottom_level_tracer bvh;         // over the scene triangles [first_triangle, first_triangle+triangle_count)
+		unsigned first_triangle, triangle_count;
+		aabb box;
+	};
+	struct placement {
+		unsigned object;
+		uint32_t instance;               // triangle_intersection::no_instance for the object itself
+		glm::mat4 to_object;             // inverse of the instance's trafo
+		aabb box;
+	};
+	// Same encoding as binary_bvh_tracer::node, leaves reference placements
+	struct node {
+		aabb box_l, box_r;
+		int32_t link_l, link_r;
+		bool inner() const { return link_r >= 0; }
+		int32_t first() const { return -link_l; }
+		int32_t count() const { return -link_r; }
+	};
+
+	bottom_level_tracer config;          // receives the bvh commands, copied for each bottom level
+	std::vector<bottom_level*> bottom;   // one per scene object
+	std::vector<placement> placements;
+	std::vector<node> nodes;
+	uint32_t root = 0;
+	uint32_t levels = 0;
+	float bottom_level_ms = 0, top_level_ms = 0;
+
+	~two_level_bvh_tracer();
+	void build(::scene *scene) override;
+	void refit() override;
+	triangle_intersection closest_hit(const ray &ray) override;
+	bool any_hit(const ray &ray) override;
+	bool interprete(const std::string &command, std::istringstream &in) override;
+
+private:
+	bool bottom_level_current(unsigned object) const;
+	void restore_load_order();
+	aabb triangle_bounds(const bottom_level &b) const;
+	unsigned build_bottom_levels();
+	void build_top_level();
+	uint32_t subdivide(uint32_t start, uint32_t end);
+	::ray to_object(const ::ray &ray, const placement &p) const;
+	bool settings_changed = true;
+};
@@ -0,0 +1,208 @@
+#include "wbvh.h"
+#include "simd.h"
+
+#include "libgi/timer.h"
+
+#include <iostream>
+#include <chrono>
+
+//
+//    SIMD box test, see simd.h for the lanes
+//
+
+namespace {
+	/* Slab test of all W children at once, returns the bit mask of children hit within [t_min,t_max] and stores the
+	 * entry distances. The near and far planes are picked by the signs of the ray direction.
+	 */
+	template<int W, typename node>
+	inline int intersect_children(const node &n, const ray &ray, float t_max, float *dist) {
+		typedef lanes<W> L;
+		typename L::f ix = L::set1(ray.id.x), iy = L::set1(ray.id.y), iz = L::set1(ray.id.z);
+		typename L::f ox = L::set1(ray.oid.x), oy = L::set1(ray.oid.y), oz = L::set1(ray.oid.z);
+		const float *near_x = ray.sign[0] ? n.max_x : n.min_x, *far_x = ray.sign[0] ? n.min_x : n.max_x;
+		const float *near_y = ray.sign[1] ? n.max_y : n.min_y, *far_y = ray.sign[1] ? n.min_y : n.max_y;
+		const float *near_z = ray.sign[2] ? n.max_z : n.min_z, *far_z = ray.sign[2] ? n.min_z : n.max_z;
+		typename L::f t1x = L::sub(L::mul(L::load(near_x), ix), ox), t2x = L::sub(L::mul(L::load(far_x), ix), ox);
+		typename L::f t1y = L::sub(L::mul(L::load(near_y), iy), oy), t2y = L::sub(L::mul(L::load(far_y), iy), oy);
+		typename L::f t1z = L::sub(L::mul(L::load(near_z), iz), oz), t2z = L::sub(L::mul(L::load(far_z), iz), oz);
+		typename L::f t_near = L::max(L::max(t1x, t1y), L::max(t1z, L::set1(ray.t_min)));
+		typename L::f t_far  = L::min(L::min(t2x, t2y), L::min(t2z, L::set1(t_max)));
+		L::store(dist, t_near);
+		return L::le(t_near, t_far) & ((1 << n.children) - 1);
+	}
+}
+
+//
+//    wide_bvh_tracer
+//
+
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+void wide_bvh_tracer<W, tr_layout, esc_mode>::build(::scene *scene) {
+	this->scene = scene;
+	binary.build(scene);
+	std::cout << "Collapsing to a " << W << "-wide BVH..." << std::endl;
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	nodes.clear();
+	max_depth = 0;
+	collapse(binary.root, 1);
+	index = binary.index;
+
+	auto t2 = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+	std::cout << "Done after " << duration << "ms" << std::endl;
+}
+
+/* Bildet einen breiten Knoten aus dem binären Knoten und so vielen seiner Nachfahren, dass W Kinder entstehen. Dazu
+ * wird immer das (innere) Kind mit der größten Oberfläche durch seine beiden Kinder ersetzt.
+ */
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+uint32_t wide_bvh_tracer<W, tr_layout, esc_mode>::collapse(uint32_t binary_node, uint32_t depth) {
+	auto box_surface = [&](const aabb &box) {
+		vec3 extent = box.max - box.min;
+		return (2*(extent.x*extent.y+extent.x*extent.z+extent.y*extent.z));
+	};
+	const auto &bin = binary.nodes;
+	max_depth = std::max(max_depth, depth);
+	uint32_t id = nodes.size();
+	nodes.emplace_back();
+
+	aabb box[W];
+	uint32_t child[W];
+	int n = 0;
+	if (bin[binary_node].inner()) {
+		box[0] = bin[binary_node].box_l; child[0] = bin[binary_node].link_l;
+		box[1] = bin[binary_node].box_r; child[1] = bin[binary_node].link_r;
+		n = 2;
+	}
+	else {
+		// Der ganze Baum ist nur ein Blatt
+		for (int i = 0; i < bin[binary_node].tri_count(); ++i) {
+			const triangle &tri = scene->triangles[binary.index.empty() ? bin[binary_node].tri_offset()+i
+			                                                            : binary.index[bin[binary_node].tri_offset()+i]];
+			box[0].grow(scene->vertices[tri.a].pos);
+			box[0].grow(scene->vertices[tri.b].pos);
+			box[0].grow(scene->vertices[tri.c].pos);
+		}
+		child[0] = binary_node;
+		n = 1;
+	}
+	while (n < W) {
+		int largest = -1;
+		for (int i = 0; i < n; ++i)
+			if (bin[child[i]].inner() && (largest == -1 || box_surface(box[i]) > box_surface(box[largest])))
+				largest = i;
+		if (largest == -1)
+			break;
+		const auto &expand = bin[child[largest]];
+		box[n] = expand.box_r; child[n] = expand.link_r;
+		box[largest] = expand.box_l; child[largest] = expand.link_l;
+		n++;
+	}
+
+	for (int i = 0; i < W; ++i)
+		nodes[id].set_box(i, i < n ? box[i] : aabb());
+	nodes[id].children = n;
+	for (int i = 0; i < W; ++i) {
+		if (i >= n) {
+			nodes[id].link[i] = nodes[id].count[i] = 0;
+		}
+		else if (bin[child[i]].inner()) {
+			uint32_t link = collapse(child[i], depth+1);
+			nodes[id].link[i] = link;
+			nodes[id].count[i] = 0;
+		}
+		else {
+			nodes[id].link[i] = bin[child[i]].tri_offset();
+			nodes[id].count[i] = bin[child[i]].tri_count();
+		}
+	}
+	return id;
+}
+
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+triangle_intersection wide_bvh_tracer<W, tr_layout, esc_mode>::closest_hit(const ray &ray) {
+	time_this_block(closest_hit);
+	struct entry { int32_t link, count; float dist; };
+	traversal_stack<entry, 256> stack(max_depth * (W-1) + 1);
+	int32_t sp = 0;
+	stack[0] = { 0, 0, ray.t_min };
+	triangle_intersection closest;
+	alignas(32) float dist[W];
+	while (sp >= 0) {
+		entry e = stack[sp--];
+		if (e.dist >= closest.t)
+			continue;
+		if (e.count == 0) {
+			const node &n = nodes[e.link];
+			int hit = intersect_children<W>(n, ray, std::min(ray.t_max, closest.t), dist);
+			// Getroffene Kinder nach Entfernung sortiert ablegen, das nächste zuletzt (d.h. oben auf dem Stack)
+			int first = sp+1;
+			for (; hit; hit &= hit-1) {
+				int i = __builtin_ctz(hit);
+				entry c = { n.link[i], n.count[i], dist[i] };
+				int j = ++sp;
+				while (j > first && stack[j-1].dist < c.dist) {
+					stack[j] = stack[j-1];
+					--j;
+				}
+				stack[j] = c;
+			}
+		}
+		else {
+			binary.intersect_leaf(e.link, e.count, ray, closest);
+		}
+	}
+	return closest;
+}
+
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+bool wide_bvh_tracer<W, tr_layout, esc_mode>::any_hit(const ray &ray) {
+	time_this_block(any_hit);
+	struct entry { int32_t link, count; };
+	traversal_stack<entry, 256> stack(max_depth * (W-1) + 1);
+	int32_t sp = 0;
+	stack[0] = { 0, 0 };
+	alignas(32) float dist[W];
+	while (sp >= 0) {
+		entry e = stack[sp--];
+		if (e.count == 0) {
+			const node &n = nodes[e.link];
+			for (int hit = intersect_children<W>(n, ray, ray.t_max, dist); hit; hit &= hit-1) {
+				int i = __builtin_ctz(hit);
+				stack[++sp] = { n.link[i], n.count[i] };
+			}
+		}
+		else {
+			if (binary.any_hit_leaf(e.link, e.count, ray))
+				return true;
+		}
+	}
+	return false;
+}
+
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+bool wide_bvh_tracer<W, tr_layout, esc_mode>::interprete(const std::string &command, std::istringstream &in) {
+	// All bvh commands configure the binary tree, statistics are extended by the wide one
+	std::streampos pos = in.tellg();
+	std::string value;
+	in >> value;
+	in.clear();
+	in.seekg(pos);
+	if (!binary.interprete(command, in))
+		return false;
+	build_settings_changed = binary.build_settings_changed;
+	binary.build_settings_changed = false;
+	if (command == "bvh" && value == "statistics") {
+		std::cout << W << "-wide nodes: " << nodes.size() << " (boxes tested as " << lanes<W>::name << ")" << std::endl;
+		std::cout << W << "-wide depth: " << max_depth << std::endl;
+	}
+	return true;
+}
+
+template class wide_bvh_tracer<4, bbvh_triangle_layout::flat,    bbvh_esc_mode::off>;
+template class wide_bvh_tracer<4, bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
+template class wide_bvh_tracer<4, bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
+template class wide_bvh_tracer<8, bbvh_triangle_layout::flat,    bbvh_esc_mode::off>;
+template class wide_bvh_tracer<8, bbvh_triangle_layout::indexed, bbvh_esc_mode::off>;
+template class wide_bvh_tracer<8, bbvh_triangle_layout::indexed, bbvh_esc_mode::on>;
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "bvh.h"
+
+/* Wide BVH, collapsed from a binary_bvh_tracer (so all the bvh commands to configure the build apply).
+ *
+ * Every node stores the bounds of its (up to) W children in SoA layout such that all of them can be tested against
+ * the ray at once (SSE for W=4, AVX for W=8 if available). A child is either an inner node or a range of triangles,
+ * i.e. the leaves of the binary tree are not stored as separate nodes.
+ */
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode>
+struct wide_bvh_tracer : public ray_tracer {
+	struct alignas(32) node {
+		float min_x[W], min_y[W], min_z[W];
+		float max_x[W], max_y[W], max_z[W];
+		int32_t link[W];   // inner child: node index, leaf child: tri_offset
+		int32_t count[W];  // 0 for inner children, tri_count for leaf children
+		int32_t children;  // number of valid slots
+		void set_box(int i, const aabb &box) {
+			min_x[i] = box.min.x; min_y[i] = box.min.y; min_z[i] = box.min.z;
+			max_x[i] = box.max.x; max_y[i] = box.max.y; max_z[i] = box.max.z;
+		}
+	};
+
+	binary_bvh_tracer<tr_layout, esc_mode> binary;
+	std::vector<node> nodes;
+	std::vector<uint32_t> index;  // can be empty if we don't use indexing
+	uint32_t max_depth = 0;
+
+	void build(::scene *scene) override;
+	triangle_intersection closest_hit(const ray &ray) override;
+	bool any_hit(const ray &ray) override;
+	bool interprete(const std::string &command, std::istringstream &in) override;
+
+private:
+	uint32_t collapse(uint32_t binary_node, uint32_t depth);
+	int triangle_index(int i) const { return index.empty() ? i : index[i]; }
+};
@@ -0,0 +1,271 @@
+/*
+ * 	Checks the traversal variants of the bvh tracers against the sequential reference (seq_tri_is).
+ *
+ * 	All variants trace the same rays through the same (random) scene and have to find the same closest hits, occlusion
+ * 	results and packet results as the reference.  The exit code is the number of variants that did not.
+ *
+ */
+#include "libgi/scene.h"
+#include "libgi/intersect.h"
+
+#include "rt/seq/seq.h"
+#include "rt/bbvh-base/bvh.h"
+#include "rt/bbvh-base/wbvh.h"
+#include "rt/bbvh-base/tlbvh.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+//! Small and long triangles spread over a cube, a few degenerate ones and a dense cluster in the middle
+static void make_scene(scene &s, int n) {
+	mt19937 rng(7);
+	uniform_real_distribution<float> u(0, 1);
+	for (int i = 0; i < n; ++i) {
+		vec3 c(u(rng)*100, u(rng)*100, u(rng)*100);
+		float size = i % 10 == 0 ? 40.0f : 2.0f;
+		uint32_t base = s.vertices.size();
+		for (int k = 0; k < 3; ++k) {
+			vertex v;
+			v.pos = c + vec3(u(rng)-0.5f, u(rng)-0.5f, u(rng)-0.5f) * size;
+			v.norm = vec3(0, 1, 0);
+			s.vertices.push_back(v);
+		}
+		if (i % 10 == 1)
+			s.vertices.back().pos = s.vertices[base].pos;
+		s.triangles.push_back({base, base+1, base+2, 0});
+	}
+	for (int i = 0; i < n/4; ++i) {
+		vec3 c(50 + u(rng)*0.01f, 50 + u(rng)*0.01f, 50 + u(rng)*0.01f);
+		uint32_t base = s.vertices.size();
+		for (int k = 0; k < 3; ++k) {
+			vertex v;
+			v.pos = c + vec3(u(rng), u(rng), u(rng)) * 0.5f;
+			v.norm = vec3(0, 1, 0);
+			s.vertices.push_back(v);
+		}
+		s.triangles.push_back({base, base+1, base+2, 0});
+	}
+	for (unsigned i = 0; i < s.triangles.size(); i += 97)
+		s.objects.push_back({"object " + to_string(i), i, std::min(unsigned(s.triangles.size()), i+97), 0});
+	for (auto &v : s.vertices)
+		s.scene_bounds.grow(v.pos);
+}
+
+//! Places instances of the objects of \c s and adds their geometry to the reference scene
+static void place_instances(scene &s, scene &reference) {
+	mt19937 rng(1);
+	uniform_real_distribution<float> u(0, 1);
+	for (int i = 0; i < 40; ++i) {
+		scene::instance in;
+		in.name = "instance " + to_string(i);
+		in.object = unsigned(u(rng) * s.objects.size()) % s.objects.size();
+		in.place(translate(mat4(1), vec3(u(rng)*100, u(rng)*100, u(rng)*100))
+		         * rotate(mat4(1), u(rng)*6, vec3(u(rng), 1, u(rng)))
+		         * scale(mat4(1), vec3(0.5f + u(rng))));
+		s.instances.push_back(in);
+		auto &object = s.objects[in.object];
+		for (unsigned t = object.start; t < object.end; ++t) {
+			uint32_t base = reference.vertices.size();
+			for (uint32_t v : {s.triangles[t].a, s.triangles[t].b, s.triangles[t].c}) {
+				vertex placed = s.vertices[v];
+				placed.pos = vec3(in.trafo * vec4(placed.pos, 1));
+				reference.vertices.push_back(placed);
+			}
+			reference.triangles.push_back({base, base+1, base+2, 0});
+		}
+	}
+}
+
+struct variant {
+	string name;
+	function<ray_tracer*()> make;
+	vector<string> commands;
+	bool instanced = false;
+	function<void(scene &s, scene &reference, ray_tracer *rt)> after_build;  // e.g. change the scene and refit
+};
+
+//! The second build loads what the first one stored
+static void build_again(scene &s, scene &, ray_tracer *rt) {
+	rt->build(&s);
+}
+
+//! Moves every vertex in both scenes the same way, so that the tree has to be refitted
+static void move_vertices_and_refit(scene &s, scene &reference, ray_tracer *rt) {
+	auto move = [](scene &scene) {
+		for (auto &v : scene.vertices)
+			v.pos += vec3(3 * sinf(v.pos.y * 0.1f), 0, 2 * cosf(v.pos.x * 0.05f));
+	};
+	move(s);
+	move(reference);
+	rt->refit();
+}
+
+template<bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode = bbvh_esc_mode::off,
+         bbvh_node_format node_format = bbvh_node_format::full>
+ray_tracer* binary() {
+	return new binary_bvh_tracer<tr_layout, esc_mode, node_format>;
+}
+
+template<int W, bbvh_triangle_layout tr_layout, bbvh_esc_mode esc_mode = bbvh_esc_mode::off>
+ray_tracer* wide() {
+	return new wide_bvh_tracer<W, tr_layout, esc_mode>;
+}
+
+static bool same_hit(const triangle_intersection &a, const triangle_intersection &b) {
+	if (a.valid() != b.valid())
+		return false;
+	return !a.valid() || fabs(a.t - b.t) <= 1e-3f * std::max(1.0f, a.t);
+}
+
+//! The reported triangle (and instance) has to be hit at the reported distance, also after the tracer reordered them
+static bool hit_resolves(const scene &s, const ray &ray, const triangle_intersection &hit) {
+	if (!hit.valid())
+		return true;
+	const triangle &tri = s.triangles[hit.ref];
+	vertex v[3] = { s.instanced_vertex(tri.a, hit.instance),
+	                s.instanced_vertex(tri.b, hit.instance),
+	                s.instanced_vertex(tri.c, hit.instance) };
+	triangle local = {0, 1, 2, 0};
+	triangle_intersection is;
+	return intersect(local, v, ray, is) && fabs(is.t - hit.t) <= 1e-3f * std::max(1.0f, hit.t);
+}
+
+//! Number of rays for which \c rt does not agree with the reference
+static int check(const variant &variant, int n) {
+	scene reference, s;
+	make_scene(reference, n);
+	make_scene(s, n);
+	if (variant.instanced)
+		place_instances(s, reference);
+	seq_tri_is *seq = new seq_tri_is;
+	reference.rt = seq;
+	seq->build(&reference);
+
+	ray_tracer *rt = variant.make();
+	s.rt = rt;
+	for (const string &line : variant.commands) {
+		istringstream in(line);
+		string command;
+		in >> command;
+		if (!rt->interprete(command, in)) {
+			cerr << variant.name << ": command not accepted: " << line << endl;
+			return 1;
+		}
+	}
+	rt->build(&s);
+	if (variant.after_build)
+		variant.after_build(s, reference, rt);
+
+	mt19937 rng(3);
+	uniform_real_distribution<float> u(0, 1);
+	auto random_ray = [&]() {
+		vec3 o(u(rng)*120-10, u(rng)*120-10, u(rng)*120-10);
+		vec3 d(u(rng)-0.5f, u(rng)-0.5f, u(rng)-0.5f);
+		return ray(o, normalize(d));
+	};
+
+	int bad = 0;
+	for (int i = 0; i < 5000; ++i) {
+		ray r = random_ray();
+		if (i % 7 == 0)
+			r = ray(r.o, vec3(1, 0, 0));
+		triangle_intersection expected = seq->closest_hit(r), hit = rt->closest_hit(r);
+		if (!same_hit(expected, hit) || !hit_resolves(s, r, hit))
+			++bad;
+		if (seq->any_hit(r) != rt->any_hit(r))
+			++bad;
+	}
+	// Shadow rays of finite length
+	vec3 light(50, 130, 50);
+	for (int i = 0; i < 5000; ++i) {
+		vec3 p(u(rng)*100, u(rng)*100, u(rng)*100);
+		ray r(p, normalize(light - p));
+		r.length_exclusive(length(light - p));
+		if (seq->any_hit(r) != rt->any_hit(r))
+			++bad;
+	}
+	// Coherent packets, some of them not full
+	for (int k = 0; k < 200; ++k) {
+		ray center = random_ray();
+		if (k % 5 == 0)
+			center = ray(center.o, normalize(vec3(1, 0.001f, 0)));
+		ray_packet packet;
+		packet.n = k % 7 == 0 ? 37 : ray_packet::size;
+		for (unsigned i = 0; i < packet.n; ++i) {
+			vec3 offset(float(i % 8) - 3.5f, float(i / 8) - 3.5f, 0.5f * (float(i % 3) - 1));
+			packet.rays[i] = ray(center.o, normalize(center.d + offset * 0.01f));
+		}
+		triangle_intersection hits[ray_packet::size];
+		rt->closest_hit_packet(packet, hits);
+		for (unsigned i = 0; i < packet.n; ++i)
+			if (!same_hit(seq->closest_hit(packet.rays[i]), hits[i]))
+				++bad;
+	}
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 4000;
+	char cache_dir[] = "/tmp/rtgi-test-cache-XXXXXX";
+	if (!mkdtemp(cache_dir)) {
+		cerr << "Cannot create a directory for the bvh cache" << endl;
+		return 1;
+	}
+	typedef bbvh_triangle_layout tl;
+	typedef bbvh_esc_mode esc;
+	typedef bbvh_node_format nf;
+	vector<variant> variants = {
+		{ "bbvh flat",                     binary<tl::flat>,    {} },
+		{ "bbvh indexed",                  binary<tl::indexed>, {} },
+		{ "bbvh esc",                      binary<tl::indexed, esc::on>, {} },
+		{ "bbvh esc, mailbox on",          binary<tl::indexed, esc::on>, {"bvh triangles multiple 4", "bvh mailbox on"} },
+		{ "bbvh sah-full",                 binary<tl::indexed>, {"bvh sah-full"} },
+		{ "bbvh sbvh",                     binary<tl::indexed>, {"bvh sbvh"} },
+		{ "bbvh lbvh",                     binary<tl::flat>,    {"bvh lbvh"} },
+		{ "bbvh binned-sah",               binary<tl::indexed>, {"bvh binned-sah 16"} },
+		{ "parallel build",                binary<tl::flat>,    {"bvh parallel on", "bvh parallel cutoff 64", "bvh triangles multiple 4"} },
+		{ "parallel binned-sah",           binary<tl::indexed>, {"bvh binned-sah 8", "bvh parallel on", "bvh parallel cutoff 64"} },
+		{ "treelet optimization",          binary<tl::indexed>, {"bvh optimize 2"} },
+		{ "cache store, then load",        binary<tl::indexed>, {string("bvh cache ") + cache_dir}, false, build_again },
+		{ "layout bfs, colocated",         binary<tl::indexed>, {"bvh layout bfs 4", "bvh layout colocate on"} },
+		{ "layout veb, colocated",         binary<tl::flat>,    {"bvh layout veb", "bvh layout colocate on"} },
+		{ "refit after moving vertices",   binary<tl::indexed>, {}, false, move_vertices_and_refit },
+		{ "refit after moving, flat",      binary<tl::flat>,    {}, false, move_vertices_and_refit },
+		{ "kernel moeller",                binary<tl::indexed>, {"bvh kernel moeller"} },
+		{ "kernel baldwin",                binary<tl::indexed>, {"bvh kernel baldwin"} },
+		{ "kernel woop (watertight)",      binary<tl::indexed>, {"bvh kernel woop"} },
+		{ "box kernel simd",               binary<tl::indexed>, {"bvh kernel simd"} },
+		{ "triangle blocks of 8",          binary<tl::indexed>, {"bvh triangles multiple 8", "bvh triangles blocks 8"} },
+		{ "triangle records",              binary<tl::indexed>, {"bvh triangles records on"} },
+		{ "restart-trail traversal",       binary<tl::indexed>, {"bvh traversal restart-trail"} },
+		{ "occlusion order distance",      binary<tl::indexed>, {"bvh occlusion order distance"} },
+		{ "quantized 8 bit",               binary<tl::flat, esc::off, nf::quantized8>,  {} },
+		{ "quantized 16 bit",              binary<tl::flat, esc::off, nf::quantized16>, {} },
+		{ "quantized 8 bit, esc",          binary<tl::indexed, esc::on, nf::quantized8>, {} },
+		{ "wide 4",                        wide<4, tl::flat>,    {} },
+		{ "wide 8",                        wide<8, tl::indexed>, {} },
+		{ "wide 8, esc",                   wide<8, tl::indexed, esc::on>, {} },
+		{ "two-level",                     []() -> ray_tracer* { return new two_level_bvh_tracer; }, {} },
+		{ "two-level, instanced",          []() -> ray_tracer* { return new two_level_bvh_tracer; }, {}, true },
+	};
+	int failed = 0;
+	for (auto &v : variants) {
+		int bad = check(v, n);
+		cout << (bad ? "FAIL " : "ok   ") << v.name;
+		if (bad) cout << " (" << bad << " mismatches)";
+		cout << endl;
+		failed += bad != 0;
+	}
+	system((string("rm -rf ") + cache_dir).c_str());
+	return failed;
+}